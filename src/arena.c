@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include "arena.h"
+#include "utils.h"
+
+#define ARENA_ALIGNMENT 16
+
+ArenaBlock* new_arena_block(size_t size, ArenaBlock* pnext){
+    ArenaBlock* pres = (ArenaBlock*) malloc(sizeof(ArenaBlock) + size);
+    check_allocation(pres, "Couldn't allocate memory for the arena\n");
+    pres->next = pnext;
+    pres->size = size;
+    pres->used = 0;
+    return pres;
+}
+
+void init_arena(Arena* parena, size_t block_size){
+    parena->head = NULL;
+    parena->block_size = block_size;
+    parena->high_water = 0;
+}
+
+void* arena_alloc(Arena* parena, size_t size){
+    size = (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+    ArenaBlock* pblock = parena->head;
+    if (pblock == NULL || pblock->used + size > pblock->size){
+        size_t block_size = size > parena->block_size ? size : parena->block_size;
+        pblock = new_arena_block(block_size, parena->head);
+        parena->head = pblock;
+    }
+    void* pres = pblock->data + pblock->used;
+    pblock->used += size;
+    return pres;
+}
+
+// Gives everything back. The memory is kept for next time in a single block
+// big enough for the most we ever needed, so a steady workload stops allocating
+// after a few rounds and a reset is just a pointer going back to the start
+void reset_arena(Arena* parena){
+    ArenaBlock* pblock = parena->head;
+    if (pblock == NULL)
+        return;
+
+    size_t used = 0;
+    for (ArenaBlock* pcur = pblock; pcur != NULL; pcur = pcur->next)
+        used += pcur->used;
+    if (used > parena->high_water)
+        parena->high_water = used;
+
+    if (pblock->next == NULL && pblock->size >= parena->high_water){
+        pblock->used = 0;
+        return;
+    }
+
+    free_arena(parena);
+    size_t block_size = parena->high_water > parena->block_size ? parena->high_water : parena->block_size;
+    parena->head = new_arena_block(block_size, NULL);
+}
+
+void free_arena(Arena* parena){
+    ArenaBlock* pblock = parena->head;
+    while (pblock != NULL){
+        ArenaBlock* pnext = pblock->next;
+        free(pblock);
+        pblock = pnext;
+    }
+    parena->head = NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Memory handed out by bumping a pointer, and given back all at once.
+// Blocks are chained when the current one is full
+typedef struct _ab {
+    struct _ab* next;
+    size_t size, used;
+    char data[] __attribute__((aligned(16)));
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+    size_t block_size;
+    size_t high_water; // Most memory ever used between two resets
+} Arena;
+
+void init_arena(Arena* parena, size_t block_size);
+void* arena_alloc(Arena* parena, size_t size);
+void reset_arena(Arena* parena);
+void free_arena(Arena* parena);
+
+#endif
@@ -0,0 +1,208 @@
+#define LEAF_SIZE 4
+#define STACK_DEPTH 64
+
+#include <stdlib.h>
+#include <math.h>
+#include "bvh.h"
+#include "vect.h"
+#include "utils.h"
+
+// Triangles are sorted along with their centroid while building
+typedef struct {
+    Triangle tri;
+    Point3D centroid;
+} BuildTriangle;
+
+float get_axis(Point3D pt, int axis){
+    return axis == 0 ? pt.x : (axis == 1 ? pt.y : pt.z);
+}
+
+void swap_build_triangles(BuildTriangle* ptris, int i, int j){
+    BuildTriangle tmp = ptris[i];
+    ptris[i] = ptris[j];
+    ptris[j] = tmp;
+}
+
+// Quickselect (Hoare's partition, which copes well with equal keys):
+// reorders ptris[start] to ptris[end - 1] so that the ones before mid don't
+// have larger centroids along axis than the ones after it
+void select_median(BuildTriangle* ptris, int start, int end, int mid, int axis){
+    int lo = start, hi = end - 1, i, j;
+    float pivot;
+    while (lo < hi){
+        pivot = get_axis(ptris[(lo + hi) / 2].centroid, axis);
+        i = lo;
+        j = hi;
+        while (i <= j){
+            while (get_axis(ptris[i].centroid, axis) < pivot)
+                i += 1;
+            while (get_axis(ptris[j].centroid, axis) > pivot)
+                j -= 1;
+            if (i <= j){
+                swap_build_triangles(ptris, i, j);
+                i += 1;
+                j -= 1;
+            }
+        }
+        if (mid <= j)
+            hi = j;
+        else if (mid >= i)
+            lo = i;
+        else
+            return;
+    }
+}
+
+// Builds the subtree for ptris[start] to ptris[end - 1], returns its index
+int build_node(BVH* pbvh, BuildTriangle* ptris, int start, int end){
+    int idx = pbvh->size++;
+    BVHNode* pnode = &pbvh->nodes[idx];
+
+    BoundingBox bbox = bbox_from_triangle(ptris[start].tri),
+                centroids = {ptris[start].centroid, ptris[start].centroid},
+                tri_bbox;
+    for (int i = start + 1; i < end; i++){
+        tri_bbox = bbox_from_triangle(ptris[i].tri);
+        bbox.min = pt_min(bbox.min, tri_bbox.min);
+        bbox.max = pt_max(bbox.max, tri_bbox.max);
+        centroids.min = pt_min(centroids.min, ptris[i].centroid);
+        centroids.max = pt_max(centroids.max, ptris[i].centroid);
+    }
+    pnode->bbox = bbox;
+
+    if (end - start <= LEAF_SIZE){
+        pnode->start = start;
+        pnode->count = end - start;
+        return idx;
+    }
+
+    // Splitting along the longest axis of the centroids' bounding box, at the
+    // median so that the tree stays balanced
+    Point3D extent = pt_diff(centroids.max, centroids.min);
+    int axis = 0;
+    if (extent.y > extent.x)
+        axis = 1;
+    if (extent.z > get_axis(extent, axis))
+        axis = 2;
+    int mid = (start + end) / 2;
+    select_median(ptris, start, end, mid, axis);
+
+    pnode->count = 0;
+    build_node(pbvh, ptris, start, mid);
+    pbvh->nodes[idx].right = build_node(pbvh, ptris, mid, end);
+    return idx;
+}
+
+BVH* build_bvh(TriangleMesh* pmesh){
+    BVH* pres = (BVH*) malloc(sizeof(BVH));
+    check_allocation(pres, "Couldn't allocate memory for the BVH\n");
+    pres->size = 0;
+    // A binary tree with n leaves has at most 2n - 1 nodes
+    pres->nodes = (BVHNode*) malloc((2 * pmesh->size + 1) * sizeof(BVHNode));
+    pres->triangles = (Triangle*) malloc((pmesh->size + 1) * sizeof(Triangle));
+    check_allocation(pres->nodes, "Couldn't allocate memory for the BVH\n");
+    check_allocation(pres->triangles, "Couldn't allocate memory for the BVH\n");
+    if (pmesh->size == 0)
+        return pres;
+
+    BuildTriangle* ptris = (BuildTriangle*) malloc(pmesh->size * sizeof(BuildTriangle));
+    check_allocation(ptris, "Couldn't allocate memory for the BVH\n");
+    for (int i = 0; i < pmesh->size; i++){
+        ptris[i].tri = get_triangle(pmesh, i);
+        ptris[i].centroid = pt_mul((float)1/3, pt_add(pt_add(ptris[i].tri.a,
+                                                             ptris[i].tri.b),
+                                                      ptris[i].tri.c));
+    }
+
+    build_node(pres, ptris, 0, pmesh->size);
+
+    // Keeping the triangles in leaf order
+    for (int i = 0; i < pmesh->size; i++){
+        pres->triangles[i] = ptris[i].tri;
+    }
+    free(ptris);
+    return pres;
+}
+
+void free_bvh(BVH* pbvh){
+    free(pbvh->nodes);
+    free(pbvh->triangles);
+    free(pbvh);
+}
+
+// Slab test, tells if the ray enters the box before max_t
+bool ray_hits_bbox(BoundingBox* pbbox, Point3D origin, Point3D inv_dir, float max_t){
+    float t1 = (pbbox->min.x - origin.x) * inv_dir.x,
+          t2 = (pbbox->max.x - origin.x) * inv_dir.x;
+    float t_min = fminf(t1, t2),
+          t_max = fmaxf(t1, t2);
+
+    t1 = (pbbox->min.y - origin.y) * inv_dir.y;
+    t2 = (pbbox->max.y - origin.y) * inv_dir.y;
+    t_min = fmaxf(t_min, fminf(t1, t2));
+    t_max = fminf(t_max, fmaxf(t1, t2));
+
+    t1 = (pbbox->min.z - origin.z) * inv_dir.z;
+    t2 = (pbbox->max.z - origin.z) * inv_dir.z;
+    t_min = fmaxf(t_min, fminf(t1, t2));
+    t_max = fminf(t_max, fmaxf(t1, t2));
+
+    return t_max >= fmaxf(t_min, 0) && t_min < max_t;
+}
+
+// Moller-Trumbore, tells if the ray crosses the triangle between 0 and max_t
+bool ray_hits_triangle(Triangle* ptri, Point3D origin, Point3D dir, float max_t){
+    Point3D e1 = pt_diff(ptri->b, ptri->a),
+            e2 = pt_diff(ptri->c, ptri->a),
+            p = cross_product(dir, e2);
+    float det = dot_product(e1, p);
+    // The ray is parallel to the triangle
+    if (det == 0)
+        return false;
+
+    float inv_det = 1 / det;
+    Point3D s = pt_diff(origin, ptri->a);
+    float u = dot_product(s, p) * inv_det;
+    if (u < 0 || u > 1)
+        return false;
+
+    Point3D q = cross_product(s, e1);
+    float v = dot_product(dir, q) * inv_det;
+    if (v < 0 || u + v > 1)
+        return false;
+
+    float t = dot_product(e2, q) * inv_det;
+    return t > 0 && t < max_t;
+}
+
+// Tells if a triangle crosses the segment going from origin to target, before
+// max_ratio of its length. Stops at the first one found
+bool segment_is_occluded(BVH* pbvh, Point3D origin, Point3D target, float max_ratio){
+    if (pbvh->size == 0)
+        return false;
+
+    Point3D dir = pt_diff(target, origin);
+    Point3D inv_dir = {1 / dir.x, 1 / dir.y, 1 / dir.z};
+
+    int stack[STACK_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+
+    BVHNode* pnode;
+    while (top > 0){
+        pnode = &pbvh->nodes[stack[--top]];
+        if (!ray_hits_bbox(&pnode->bbox, origin, inv_dir, max_ratio))
+            continue;
+
+        if (pnode->count > 0){
+            for (int i = pnode->start; i < pnode->start + pnode->count; i++){
+                if (ray_hits_triangle(&pbvh->triangles[i], origin, dir, max_ratio))
+                    return true;
+            }
+        } else {
+            stack[top++] = pnode->right;
+            stack[top++] = pnode - pbvh->nodes + 1;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,27 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdbool.h>
+#include "primitives.h"
+
+// Bounding volume hierarchy over the triangles of a mesh, in world space.
+// Nodes are stored depth first: an inner node's left child comes right after
+// it, and right holds the index of its right child. Leaves have count > 0
+// and point to triangles[start] to triangles[start + count - 1]
+typedef struct {
+    BoundingBox bbox;
+    int right;
+    int start, count;
+} BVHNode;
+
+typedef struct {
+    int size;
+    BVHNode* nodes;
+    Triangle* triangles;
+} BVH;
+
+BVH* build_bvh(TriangleMesh* pmesh);
+void free_bvh(BVH* pbvh);
+bool segment_is_occluded(BVH* pbvh, Point3D origin, Point3D target, float max_ratio);
+
+#endif
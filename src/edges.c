@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "edges.h"
+#include "utils.h"
+
+uint32_t hash_edge(int a, int b){
+    return ((uint32_t) a * 73856093u) ^ ((uint32_t) b * 19349663u);
+}
+
+// A face shared by more than two triangles, before it is put in place
+typedef struct {
+    int edge, face;
+} ExtraFace;
+
+// Lists the unique edges of a mesh. Vertex pairs are looked up in an open
+// addressing hash table, so an edge shared by two triangles is only added
+// once. Its visibility is the OR of the triangles' flags. Non-manifold
+// edges keep all of their triangles, the ones after the first two in a
+// list after the edges
+EdgeTable* build_edge_table(TriangleMesh* pmesh){
+    // At most three edges per triangle, keep the hash table at most half full
+    int n_slots = 1;
+    while (n_slots < 6 * pmesh->size)
+        n_slots *= 2;
+    int* pslots = (int*) malloc(n_slots * sizeof(int));
+    check_allocation(pslots, "Couldn't allocate memory for the edge table\n");
+    memset(pslots, -1, n_slots * sizeof(int));
+
+    EdgeTable* pres = (EdgeTable*) malloc(sizeof(EdgeTable) +
+                                          3 * pmesh->size * sizeof(MeshEdge));
+    check_allocation(pres, "Couldn't allocate memory for the edge table\n");
+    pres->size = 0;
+
+    int n_extra = 0, extra_capacity = 16;
+    ExtraFace* pextra = (ExtraFace*) malloc(extra_capacity * sizeof(ExtraFace));
+    check_allocation(pextra, "Couldn't allocate memory for the edge table\n");
+
+    int a, b, lo, hi;
+    uint32_t slot;
+    MeshEdge* pedge;
+    for (int i = 0; i < pmesh->size; i++){
+        for (int j = 0; j < 3; j++){
+            a = pmesh->indices[3*i + j];
+            b = pmesh->indices[3*i + (j + 1) % 3];
+            lo = a < b ? a : b;
+            hi = a < b ? b : a;
+
+            // Find the edge, or the empty slot where it goes
+            slot = hash_edge(lo, hi) & (n_slots - 1);
+            while (pslots[slot] >= 0){
+                pedge = &pres->edges[pslots[slot]];
+                if ((pedge->a == lo && pedge->b == hi) ||
+                    (pedge->a == hi && pedge->b == lo))
+                    break;
+                slot = (slot + 1) & (n_slots - 1);
+            }
+
+            if (pslots[slot] < 0){
+                // First time we see this edge
+                pslots[slot] = pres->size;
+                pedge = &pres->edges[pres->size];
+                pedge->a = a;
+                pedge->b = b;
+                pedge->faces[0] = i;
+                pedge->faces[1] = -1;
+                pedge->n_faces = 1;
+                pedge->extra = 0;
+                pedge->visible = false;
+                pres->size += 1;
+            } else if (pedge->faces[1] < 0){
+                pedge->faces[1] = i;
+                pedge->n_faces = 2;
+            } else {
+                if (n_extra >= extra_capacity){
+                    extra_capacity *= 2;
+                    pextra = realloc(pextra, extra_capacity * sizeof(ExtraFace));
+                    check_allocation(pextra, "Couldn't allocate memory for the edge table\n");
+                }
+                pextra[n_extra].edge = pslots[slot];
+                pextra[n_extra].face = i;
+                n_extra += 1;
+                pedge->n_faces += 1;
+            }
+            pedge->visible |= (pmesh->visible[i] & (1 << j)) != 0;
+        }
+    }
+    free(pslots);
+
+    // Giving back the memory we didn't use, and making room for the extra faces
+    pres = realloc(pres, sizeof(EdgeTable) + pres->size * sizeof(MeshEdge) + n_extra * sizeof(int));
+    check_allocation(pres, "Couldn't allocate memory for the edge table\n");
+    pres->pextra_faces = (int*) (pres->edges + pres->size);
+
+    // Each edge's extra faces next to each other, in the order of the triangles
+    int start = 0;
+    for (int i = 0; i < pres->size; i++){
+        pres->edges[i].extra = start;
+        start += pres->edges[i].n_faces > 2 ? pres->edges[i].n_faces - 2 : 0;
+    }
+    for (int i = 0; i < n_extra; i++)
+        pres->pextra_faces[pres->edges[pextra[i].edge].extra++] = pextra[i].face;
+    for (int i = 0; i < pres->size; i++){
+        if (pres->edges[i].n_faces > 2)
+            pres->edges[i].extra -= pres->edges[i].n_faces - 2;
+    }
+    free(pextra);
+    return pres;
+}
+
+// True if pfaces is set for any of the edge's triangles
+bool edge_has_face(EdgeTable* ptable, MeshEdge* pedge, bool* pfaces){
+    if (pfaces[pedge->faces[0]] || (pedge->faces[1] >= 0 && pfaces[pedge->faces[1]]))
+        return true;
+    for (int i = 0; i < pedge->n_faces - 2; i++){
+        if (pfaces[ptable->pextra_faces[pedge->extra + i]])
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,27 @@
+#ifndef EDGES_H
+#define EDGES_H
+
+#include <stdbool.h>
+#include "primitives.h"
+
+// An edge shared by one or more triangles of a mesh, stored only once
+typedef struct {
+    int a, b;       // Vertex indices, in the order of the first triangle using it
+    int faces[2];   // Adjacent triangles, -1 if there is none
+    int n_faces;    // Adjacent triangles, the ones after the first two are in the
+    int extra;      // table's pextra_faces, from this index on
+    bool visible;   // Is the edge visible on any of its triangles
+} MeshEdge;
+
+// The extra faces are stored right after the edges, so the table is
+// freed all at once
+typedef struct {
+    int size;
+    int* pextra_faces;
+    MeshEdge edges[];
+} EdgeTable;
+
+EdgeTable* build_edge_table(TriangleMesh* pmesh);
+bool edge_has_face(EdgeTable* ptable, MeshEdge* pedge, bool* pfaces);
+
+#endif
@@ -9,14 +9,20 @@
 #include "vect.h"
 #include "ui.h"
 #include "engine.h"
+#include "edges.h"
+#include "bvh.h"
 #include "render.h"
+#include "simd.h"
+#include "workers.h"
+#include "arena.h"
 
 #define KBSTATE_SIZE 256
 #define FPS 60
 #define EXPORT_PATH "export.bmp"
+#define FRAME_ARENA_BLOCK_SIZE (1024*1024)
 
 
-static EngineState engine_state = {false, false, false, false, true};
+static EngineState engine_state = {false, false, false, false, true, false, false};
 
 // Rendering
 static SDL_Window* pwindow = NULL;
@@ -26,7 +32,13 @@ static SDL_Texture* ptexture = NULL;
 // Model
 static char* input_file_path;
 static FILE* pfile = NULL;
+static Interpreter* pinterpreter = NULL;
 static TriangleMesh* pscene = NULL;
+static EdgeTable* pscene_edges = NULL;
+static BVH* pscene_bvh = NULL;
+static FacePlanes* pscene_planes = NULL;
+static CulledMesh* pculled = NULL; // Reused for every frame
+static Arena frame_arena;         // Memory needed only until the frame is drawn
 
 // Camera
 static Camera cam;
@@ -52,7 +64,7 @@ static SDL_Event event;
 void put_on_screen();
 void export(SDL_Renderer* prenderer);
 void load_scene();
-void render(TriangleMesh* pmesh);
+void render(CulledMesh* pculled);
 void init_rendering();
 void process_keys();
 void process_mouse();
@@ -64,6 +76,11 @@ int main(int argc, char **argv){
     input_file_path = argv[1];
 
     // Initializing
+    select_kernels();
+    start_workers(0);
+    pinterpreter = new_interpreter();
+    pculled = new_culled_mesh();
+    init_arena(&frame_arena, FRAME_ARENA_BLOCK_SIZE);
     init_rendering();
     init_ui(HEIGHT, WIDTH, prenderer);
     load_scene();
@@ -105,15 +122,16 @@ int main(int argc, char **argv){
         if (engine_state.reproject){
             update_transform_matrix(cam.transform_mat, rotation, translation,
                                     engine_state.orbit, cam.orbit_radius);
-            TriangleMesh* ptransformed = transform_and_cull(
-                    pscene, &cam, engine_state.bface_cull);
-            render(ptransformed);
-            free(ptransformed);
+            transform_and_cull(pculled, pscene, pscene_planes, &cam,
+                               engine_state.bface_cull || engine_state.depth_hlr,
+                               &frame_arena);
+            render(pculled);
+            reset_arena(&frame_arena);
             if (engine_state.do_hlr){
                 engine_state.hlr = true;
                 engine_state.do_hlr = false;
             } else {
-                engine_state.hlr = false;
+                engine_state.hlr = engine_state.depth_hlr;
             }
             engine_state.reproject = false;
         }
@@ -128,7 +146,14 @@ int main(int argc, char **argv){
     printf("Exiting...\n");
 
     // Freeing
-    free(pscene);
+    free_triangle_mesh(pscene);
+    free(pscene_edges);
+    free_bvh(pscene_bvh);
+    free(pscene_planes);
+    free_culled_mesh(pculled);
+    free_arena(&frame_arena);
+    free_interpreter(pinterpreter);
+    stop_workers();
 
     SDL_DestroyTexture(ptexture);
     SDL_DestroyRenderer(prenderer);
@@ -156,8 +181,12 @@ void export(SDL_Renderer* prenderer){
 }
 
 void load_scene(){
-    if (pscene != NULL)
-        free(pscene);
+    if (pscene != NULL){
+        free_triangle_mesh(pscene);
+        free(pscene_edges);
+        free_bvh(pscene_bvh);
+        free(pscene_planes);
+    }
     // Open input file
     pfile = fopen(input_file_path, "r");
 
@@ -165,14 +194,25 @@ void load_scene(){
         printf("No such file\n");
         exit(1);
     }
-    pscene = mesh_from_file(pfile);
+    pscene = mesh_from_file(pinterpreter, pfile);
+    // Shared edges are only drawn once
+    pscene_edges = build_edge_table(pscene);
+    // For hidden-line removal
+    pscene_bvh = build_bvh(pscene);
+    // For back-face culling
+    pscene_planes = build_face_planes(pscene);
 }
 
-void render(TriangleMesh* pmesh){
+void render(CulledMesh* pculled){
     int pitch = WIDTH * sizeof(Uint32);
     Uint32* ppixels = NULL;
     SDL_LockTexture(ptexture, NULL, (void**) &ppixels, &pitch);
-    render_mesh(pmesh, ppixels, &cam, engine_state.do_hlr);
+    HLRMode hlr_mode = HLR_NONE;
+    if (engine_state.do_hlr)
+        hlr_mode = engine_state.raycast_hlr ? HLR_RAYCAST : HLR_ANALYTIC;
+    else if (engine_state.depth_hlr)
+        hlr_mode = HLR_DEPTH_BUFFER;
+    render_mesh(pculled, pscene_edges, pscene_bvh, ppixels, &cam, hlr_mode, &frame_arena);
     SDL_UnlockTexture(ptexture);
 }
 
@@ -248,6 +288,21 @@ void process_keys(){
         engine_state.reproject = true;
     }
 
+    if (kbstate[SDL_SCANCODE_H] && !old_kbstate[SDL_SCANCODE_H]) {
+        // Toggle depth buffer hidden-line removal, on every frame
+        engine_state.depth_hlr = !engine_state.depth_hlr;
+        engine_state.reproject = true;
+    }
+
+    if (kbstate[SDL_SCANCODE_G] && !old_kbstate[SDL_SCANCODE_G]) {
+        // Switch between analytic and ray casting hidden-line removal
+        engine_state.raycast_hlr = !engine_state.raycast_hlr;
+        if (engine_state.raycast_hlr)
+            printf("Hidden-line removal: ray casting\n");
+        else
+            printf("Hidden-line removal: analytic\n");
+    }
+
     if (kbstate[SDL_SCANCODE_SPACE] && !old_kbstate[SDL_SCANCODE_SPACE]) {
         // Trigger screenshot
         export(prenderer);
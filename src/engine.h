@@ -8,7 +8,9 @@ typedef struct {
          orbit,
          hlr,
          do_hlr,
-         bface_cull;
+         bface_cull,
+         depth_hlr,
+         raycast_hlr;
 } EngineState;
 
 #endif
@@ -1,272 +1,1122 @@
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "utils.h"
 #include "transforms.h"
+#include "vect.h"
+#include "workers.h"
 #include "interpreter.h"
 
-static WorkStack wstack = {.top = 0};
-static ObjectStack ostack = {.top = 0};
+static unsigned int n_interpreters = 0;
 
-TriangleMesh* mesh_from_file(FILE* pfile){
-    // Seed random
-    srand(time(NULL));
+// Keywords are placed by (28 * first letter + last letter) % KEYWORD_TABLE_SIZE,
+// which gives each of them its own slot
+#define KEYWORD_SLOT(first, last) ((28 * (first) + (last)) % KEYWORD_TABLE_SIZE)
+static const Keyword keyword_table[KEYWORD_TABLE_SIZE] = {
+    [KEYWORD_SLOT('b', 'x')] = {"box", OP_BOX},
+    [KEYWORD_SLOT('p', 'm')] = {"prism", OP_PRISM},
+    [KEYWORD_SLOT('r', 'e')] = {"rotate", OP_ROTATE},
+    [KEYWORD_SLOT('t', 'e')] = {"translate", OP_TRANSLATE},
+    [KEYWORD_SLOT('r', 't')] = {"reflect", OP_REFLECT},
+    [KEYWORD_SLOT('m', 'e')] = {"merge", OP_MERGE},
+    [KEYWORD_SLOT('c', 'e')] = {"clone", OP_CLONE},
+    [KEYWORD_SLOT('s', 'j')] = {"swap_obj", OP_SWAP_OBJ},
+    [KEYWORD_SLOT('s', 'k')] = {"swap_work", OP_SWAP_WORK},
+    [KEYWORD_SLOT('r', 'k')] = {"rot_work", OP_ROT_WORK},
+    [KEYWORD_SLOT('r', 'j')] = {"rot_obj", OP_ROT_OBJ},
+    [KEYWORD_SLOT('r', 'd')] = {"rand", OP_RAND},
+    [KEYWORD_SLOT('a', 'd')] = {"add", OP_ADD},
+    [KEYWORD_SLOT('s', 'b')] = {"sub", OP_SUB},
+    [KEYWORD_SLOT('m', 'l')] = {"mul", OP_MUL},
+    [KEYWORD_SLOT('d', 'v')] = {"div", OP_DIV},
+    [KEYWORD_SLOT('d', 'k')] = {"dup_work", OP_DUP_WORK},
+    [KEYWORD_SLOT('d', 'j')] = {"dup_obj", OP_DUP_OBJ},
+};
+
+Interpreter* new_interpreter(){
+    Interpreter* pres = (Interpreter*) malloc(sizeof(Interpreter));
+    check_allocation(pres, "Couldn't allocate memory for the interpreter\n");
+    pres->wstack.top = 0;
+    pres->ostack.top = 0;
+    pres->rstack.top = 0;
+    pres->id = __atomic_fetch_add(&n_interpreters, 1, __ATOMIC_RELAXED);
+    pres->seed = 0;
+    pres->parenas = NULL;
+    pres->n_arenas = 0;
+    pres->pcode = NULL;
+    for (int i = 0; i < PRIMITIVE_CACHE_SIZE; i++)
+        pres->primitive_cache[i] = NULL;
+    pres->cache_hits = 0;
+    pres->cache_misses = 0;
+    return pres;
+}
+
+void free_interpreter(Interpreter* pinterp){
+    clear_obj_stack(pinterp);
+    clear_primitive_cache(pinterp);
+    if (pinterp->pcode != NULL)
+        free_bytecode(pinterp->pcode);
+    for (int i = 0; i < pinterp->n_arenas; i++)
+        free_arena(&pinterp->parenas[i]);
+    free(pinterp->parenas);
+    free(pinterp);
+}
+
+TriangleMesh* mesh_from_file(Interpreter* pinterp, FILE* pfile){
+    // Seed random, mixing in the context so that interpreters started at
+    // the same time don't all get the same numbers. Resuming from a
+    // checkpoint brings back the seed it had then
+    pinterp->seed = (unsigned int) time(NULL) ^ (pinterp->id * 2654435761u);
     // Rewind in case we already read the file before
-    wstack.top = 0;
-    ostack.top = 0;
+    pinterp->wstack.top = 0;
+    pinterp->rstack.top = 0;
+    clear_obj_stack(pinterp);
+    pinterp->cache_hits = 0;
+    pinterp->cache_misses = 0;
+
+    // Compiling only if the file changed since last time
+    struct stat file_stat = {0};
+    bool known = false;
+    if (fstat(fileno(pfile), &file_stat) == 0){
+        known = pinterp->pcode != NULL &&
+                file_stat.st_dev == pinterp->code_stat.st_dev &&
+                file_stat.st_ino == pinterp->code_stat.st_ino &&
+                file_stat.st_size == pinterp->code_stat.st_size &&
+                file_stat.st_mtim.tv_sec == pinterp->code_stat.st_mtim.tv_sec &&
+                file_stat.st_mtim.tv_nsec == pinterp->code_stat.st_mtim.tv_nsec;
+    }
+
+    // An unchanged file is run again from the start, for new random numbers.
+    // An edited one resumes after the lines that didn't change
+    int start = 0;
+    if (known){
+        printf("File unchanged, reusing compiled script\n");
+        fclose(pfile);
+    } else {
+        Bytecode* pcode = compile_script(pfile);
+        if (pinterp->pcode != NULL){
+            start = resume_position(pinterp, pinterp->pcode, pcode);
+            free_bytecode(pinterp->pcode);
+        }
+        pinterp->pcode = pcode;
+        pinterp->code_stat = file_stat;
+    }
+
+    run_bytecode(pinterp, pinterp->pcode, start);
+    printf("Work stack has %d elements, obj stack has %d\n",
+           pinterp->wstack.top, pinterp->ostack.top);
+    printf("Primitive cache: %d hits, %d misses\n",
+           pinterp->cache_hits, pinterp->cache_misses);
 
-    // Read the file and parse the tokens
-    char buffer[BUFFER_SIZE];
-    char* token = NULL;
-    char* saveptr = buffer;
-    char* read;
+    StackObject obj = pop_from_obj_stack(pinterp);
+    TriangleMesh* mesh = take_mesh(pinterp, &obj);
+    // Objects left on the stack aren't part of the result
+    clear_obj_stack(pinterp);
+    return mesh;
+}
+
+
+// Tokenizing
+// Maps the script in memory, or reads it in large chunks if it can't be
+// mapped (pipes, special files...)
+void open_source(FILE* pfile, ScriptSource* psource){
+    struct stat file_stat;
+    psource->text = NULL;
+    psource->size = 0;
+    psource->mapped = false;
+
+    if (fstat(fileno(pfile), &file_stat) == 0 && S_ISREG(file_stat.st_mode)){
+        if (file_stat.st_size == 0)
+            return;
+        void* ptext = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fileno(pfile), 0);
+        if (ptext != MAP_FAILED){
+            madvise(ptext, file_stat.st_size, MADV_SEQUENTIAL);
+            psource->text = ptext;
+            psource->size = file_stat.st_size;
+            psource->mapped = true;
+            return;
+        }
+    }
+
+    size_t capacity = 0;
+    size_t n_read;
+    char* ptext = NULL;
+    do {
+        if (psource->size + CHUNK_SIZE > capacity){
+            capacity = capacity == 0 ? CHUNK_SIZE : 2 * capacity;
+            ptext = realloc(ptext, capacity);
+            check_allocation(ptext, "Couldn't allocate memory for the script\n");
+        }
+        n_read = fread(ptext + psource->size, 1, CHUNK_SIZE, pfile);
+        psource->size += n_read;
+    } while (n_read == CHUNK_SIZE);
+    psource->text = ptext;
+}
+
+void close_source(ScriptSource* psource){
+    if (psource->mapped)
+        munmap((void*) psource->text, psource->size);
+    else
+        free((void*) psource->text);
+}
 
-    read = fgets(buffer, BUFFER_SIZE, pfile);
+bool is_delimiter(char c){
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// Finds the next token after the cursor and moves the cursor past it.
+// Returns false at the end of the text
+bool next_token(const char** pcursor, const char* end, Token* ptoken){
+    const char* pc = *pcursor;
+    while (pc < end && is_delimiter(*pc))
+        pc++;
+    if (pc == end){
+        *pcursor = pc;
+        return false;
+    }
+
+    ptoken->start = pc;
+    while (pc < end && !is_delimiter(*pc))
+        pc++;
+    ptoken->length = pc - ptoken->start;
+    *pcursor = pc;
+    return true;
+}
+
+
+// Compilation
+Bytecode* compile_script(FILE* pfile){
+    Bytecode* pres = (Bytecode*) malloc(sizeof(Bytecode));
+    check_allocation(pres, "Couldn't allocate memory for the compiled script\n");
+    pres->size = 0;
+    pres->capacity = 0;
+    pres->code = NULL;
+    pres->n_checkpoints = 0;
+    pres->checkpoints_capacity = 0;
+    pres->pcheckpoints = NULL;
+
+    // Read the file and compile the tokens
+    ScriptSource source;
+    Token token;
     printf("Reading file\n");
+    open_source(pfile, &source);
 
-    while (read != NULL){
-        token = strtok_r(buffer, delimiter, &saveptr);
+    Compiler compiler;
+    compiler.pcode = pres;
+    compiler.pwords = NULL;
+    compiler.n_words = 0;
+    compiler.words_capacity = 0;
+    compiler.n_loops = 0;
+    compiler.naming = false;
+    compiler.defining = false;
 
-        while (token != NULL){
-            parse_token(token);
-            token = strtok_r(NULL, delimiter, &saveptr);
+    // Lines outside of words and loops start with a checkpoint, along
+    // with the hash of everything before them
+    const char* cursor = source.text;
+    const char* end = source.text + source.size;
+    const char* pgap = cursor;
+    const char* phashed = cursor;
+    uint64_t hash = 14695981039346656037u;
+    int line = 1;
+    bool new_line;
+    while (next_token(&cursor, end, &token)){
+        new_line = false;
+        for (const char* pc = pgap; pc < token.start; pc++){
+            if (*pc == '\n'){
+                line++;
+                new_line = true;
+            }
+        }
+        if (new_line && pres->size > 0 && compiler.n_loops == 0 &&
+            !compiler.defining && !compiler.naming){
+            hash = hash_text(hash, phashed, token.start);
+            phashed = token.start;
+            add_checkpoint(&compiler, hash, line);
         }
-        read = fgets(buffer, BUFFER_SIZE, pfile);
+        compile_token(&compiler, token);
+        pgap = cursor;
     }
 
-    if (feof(pfile)){
-        printf("---\n");
-        printf("Reached end of file, closing.\n");
-        fclose(pfile);
+    if (compiler.naming || compiler.defining){
+        printf("Missing ; at the end of a word. Exiting\n");
+        exit(1);
+    }
+    if (compiler.n_loops > 0){
+        printf("Missing times at the end of a loop. Exiting\n");
+        exit(1);
     }
+    // The names point into the script
+    free(compiler.pwords);
+    close_source(&source);
+    printf("---\n");
+    printf("Reached end of file, closing.\n");
+    fclose(pfile);
+    printf("Compiled %d words\n", pres->size);
 
-    TriangleMesh* mesh = pop_from_obj_stack();
-    return mesh;
+    return pres;
 }
 
-void parse_token(char* token){
+void compile_token(Compiler* pcompiler, Token token){
+    Bytecode* pcode = pcompiler->pcode;
+    BytecodeWord word;
+    if (compile_control(pcompiler, token))
+        return;
+
+    const Keyword* pkeyword = find_keyword(token.start, token.length);
+    if (pkeyword != NULL){
+        word.opcode = pkeyword->opcode;
+        emit(pcode, word);
+        return;
+    }
+
+    const Word* pword = find_word(pcompiler, token);
+    if (pword != NULL){
+        word.opcode = OP_CALL;
+        emit(pcode, word);
+        emit_position(pcode, pword->start);
+        return;
+    }
+
+    // strtof needs a terminated string, the token is copied out of the script
+    char buffer[NUMBER_SIZE];
+    char* pnumber = buffer;
+    if (token.length >= NUMBER_SIZE){
+        pnumber = (char*) malloc(token.length + 1);
+        check_allocation(pnumber, "Couldn't allocate memory for a number\n");
+    }
+    memcpy(pnumber, token.start, token.length);
+    pnumber[token.length] = '\0';
+
     char* prest;
-    float parsed_number = strtof(token, &prest);
-    if (prest == token){
-        parse_instruction(token);
-    } else {
-        push_onto_work_stack(parsed_number);
-    }
-    printf("Parsed \"%s\", work stack has %d elements, obj stack has %d\n", token, wstack.top, ostack.top);
-}
-
-void parse_instruction(char* token){
-    if (strcmp(token, "box") == 0){
-        do_box();
-    } else if (strcmp(token, "prism") == 0){
-        do_prism();
-    } else if (strcmp(token, "merge") == 0){
-        do_merge();
-    } else if (strcmp(token, "rotate") == 0){
-        do_rotate();
-    } else if (strcmp(token, "translate") == 0){
-        do_translate();
-    } else if (strcmp(token, "clone") == 0){
-        do_clone();
-    } else if (strcmp(token, "swap_obj") == 0){
-        do_swap_obj();
-    } else if (strcmp(token, "swap_work") == 0){
-        do_swap_work();
-    } else if (strcmp(token, "rot_work") == 0){
-        do_rot_work();
-    } else if (strcmp(token, "rot_obj") == 0){
-        do_rot_obj();
-    } else if (strcmp(token, "rand") == 0){
-        do_rand();
-    } else if (strcmp(token, "add") == 0){
-        do_add();
-    } else if (strcmp(token, "sub") == 0){
-        do_sub();
-    } else if (strcmp(token, "mul") == 0){
-        do_mul();
-    } else if (strcmp(token, "div") == 0){
-        do_div();
-    } else if (strcmp(token, "dup_work") == 0){
-        do_dup_work();
-    } else if (strcmp(token, "dup_obj") == 0){
-        do_dup_obj();
-    } else if (strcmp(token, "reflect") == 0){
-        do_reflect();
-    } else {
-        printf("%s: Unknown instruction. Exiting\n", token);
+    float parsed_number = strtof(pnumber, &prest);
+    if (prest == pnumber){
+        printf("%s: Unknown instruction. Exiting\n", pnumber);
         exit(1);
     }
+    if (pnumber != buffer)
+        free(pnumber);
+
+    word.opcode = OP_PUSH;
+    emit(pcode, word);
+    word.value = parsed_number;
+    emit(pcode, word);
 }
 
-void push_onto_work_stack(float elem){
-    if (wstack.top >= STACK_SIZE) {
+// Handles the tokens that define words and loops. Returns false if the
+// token isn't one of them
+bool compile_control(Compiler* pcompiler, Token token){
+    Bytecode* pcode = pcompiler->pcode;
+    BytecodeWord word;
+
+    if (pcompiler->naming){
+        if (find_keyword(token.start, token.length) != NULL || token_is(token, ":") ||
+            token_is(token, ";") || token_is(token, "repeat") || token_is(token, "times")){
+            printf("%.*s: Can't be used as a word name. Exiting\n", (int) token.length, token.start);
+            exit(1);
+        }
+        // The body is skipped when the definition is reached, and only
+        // run when the word is called
+        pcompiler->naming = false;
+        pcompiler->defining = true;
+        pcompiler->definition_name = token;
+        word.opcode = OP_JUMP;
+        emit(pcode, word);
+        pcompiler->definition_jump = emit_position(pcode, 0);
+        return true;
+    }
+
+    if (token_is(token, ":")){
+        if (pcompiler->defining || pcompiler->n_loops > 0){
+            printf("Words can only be defined outside of words and loops. Exiting\n");
+            exit(1);
+        }
+        pcompiler->naming = true;
+        return true;
+    }
+
+    if (token_is(token, ";")){
+        if (!pcompiler->defining){
+            printf("; outside of a word. Exiting\n");
+            exit(1);
+        }
+        if (pcompiler->n_loops > 0){
+            printf("Missing times at the end of a loop. Exiting\n");
+            exit(1);
+        }
+        word.opcode = OP_RETURN;
+        emit(pcode, word);
+        pcode->code[pcompiler->definition_jump].position = pcode->size;
+
+        // Only known once finished, so a word can't call itself
+        if (pcompiler->n_words >= pcompiler->words_capacity){
+            pcompiler->words_capacity = pcompiler->words_capacity < 16 ? 16 : 2 * pcompiler->words_capacity;
+            pcompiler->pwords = realloc(pcompiler->pwords, pcompiler->words_capacity * sizeof(Word));
+            check_allocation(pcompiler->pwords, "Couldn't allocate memory for the words\n");
+        }
+        pcompiler->pwords[pcompiler->n_words].name = pcompiler->definition_name;
+        pcompiler->pwords[pcompiler->n_words].start = pcompiler->definition_jump + 1;
+        pcompiler->n_words++;
+        pcompiler->defining = false;
+        return true;
+    }
+
+    if (token_is(token, "repeat")){
+        if (pcompiler->n_loops >= STACK_SIZE){
+            printf("Too many nested loops. Exiting\n");
+            exit(1);
+        }
+        word.opcode = OP_REPEAT;
+        emit(pcode, word);
+        pcompiler->loops[pcompiler->n_loops++] = emit_position(pcode, 0);
+        return true;
+    }
+
+    if (token_is(token, "times")){
+        if (pcompiler->n_loops == 0){
+            printf("times without repeat. Exiting\n");
+            exit(1);
+        }
+        int exit_position = pcompiler->loops[--pcompiler->n_loops];
+        word.opcode = OP_TIMES;
+        emit(pcode, word);
+        emit_position(pcode, exit_position + 1);
+        pcode->code[exit_position].position = pcode->size;
+        return true;
+    }
+
+    return false;
+}
+
+void emit(Bytecode* pcode, BytecodeWord word){
+    if (pcode->size >= pcode->capacity){
+        pcode->capacity = pcode->capacity < 64 ? 64 : 2 * pcode->capacity;
+        pcode->code = realloc(pcode->code, pcode->capacity * sizeof(BytecodeWord));
+        check_allocation(pcode->code, "Couldn't allocate memory for the compiled script\n");
+    }
+    pcode->code[pcode->size++] = word;
+}
+
+// Returns where the position was written, so that it can be filled later
+int emit_position(Bytecode* pcode, int position){
+    BytecodeWord word;
+    word.position = position;
+    emit(pcode, word);
+    return pcode->size - 1;
+}
+
+// Perfect hash lookup, a single string comparison
+const Keyword* find_keyword(const char* token, size_t length){
+    if (length == 0)
+        return NULL;
+    const Keyword* pkeyword = &keyword_table[KEYWORD_SLOT((unsigned char) token[0],
+                                                          (unsigned char) token[length - 1])];
+    if (pkeyword->name != NULL && strncmp(pkeyword->name, token, length) == 0 &&
+        pkeyword->name[length] == '\0')
+        return pkeyword;
+    return NULL;
+}
+
+void add_checkpoint(Compiler* pcompiler, uint64_t hash, int line){
+    Bytecode* pcode = pcompiler->pcode;
+    if (pcode->n_checkpoints >= pcode->checkpoints_capacity){
+        pcode->checkpoints_capacity = pcode->checkpoints_capacity < 64 ? 64 : 2 * pcode->checkpoints_capacity;
+        pcode->pcheckpoints = realloc(pcode->pcheckpoints, pcode->checkpoints_capacity * sizeof(Checkpoint));
+        check_allocation(pcode->pcheckpoints, "Couldn't allocate memory for the checkpoints\n");
+    }
+    BytecodeWord word;
+    word.opcode = OP_CHECKPOINT;
+    emit(pcode, word);
+    emit_position(pcode, pcode->n_checkpoints);
+
+    Checkpoint* pcheckpoint = &pcode->pcheckpoints[pcode->n_checkpoints++];
+    pcheckpoint->position = pcode->size;
+    pcheckpoint->line = line;
+    pcheckpoint->hash = hash;
+    pcheckpoint->saved = false;
+}
+
+// FNV-1a, carried on from the hash of the text before start
+uint64_t hash_text(uint64_t hash, const char* start, const char* end){
+    for (const char* pc = start; pc < end; pc++){
+        hash ^= (unsigned char) *pc;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+// Latest definition first, so that words can be redefined
+const Word* find_word(Compiler* pcompiler, Token token){
+    for (int i = pcompiler->n_words - 1; i >= 0; i--){
+        Token name = pcompiler->pwords[i].name;
+        if (name.length == token.length && memcmp(name.start, token.start, token.length) == 0)
+            return &pcompiler->pwords[i];
+    }
+    return NULL;
+}
+
+bool token_is(Token token, const char* name){
+    return strncmp(name, token.start, token.length) == 0 && name[token.length] == '\0';
+}
+
+void free_bytecode(Bytecode* pcode){
+    for (int i = 0; i < pcode->n_checkpoints; i++)
+        release_checkpoint(&pcode->pcheckpoints[i]);
+    free(pcode->pcheckpoints);
+    free(pcode->code);
+    free(pcode);
+}
+
+void run_bytecode(Interpreter* pinterp, Bytecode* pcode, int start){
+    BytecodeWord* pword = pcode->code + start;
+    BytecodeWord* pend = pcode->code + pcode->size;
+    int count;
+    while (pword < pend){
+        switch ((pword++)->opcode){
+            case OP_PUSH:
+                push_onto_work_stack(pinterp, (pword++)->value);
+                break;
+            case OP_BOX: do_box(pinterp); break;
+            case OP_PRISM: do_prism(pinterp); break;
+            case OP_ROTATE: do_rotate(pinterp); break;
+            case OP_TRANSLATE: do_translate(pinterp); break;
+            case OP_REFLECT: do_reflect(pinterp); break;
+            case OP_MERGE: do_merge(pinterp); break;
+            case OP_CLONE: do_clone(pinterp); break;
+            case OP_SWAP_OBJ: do_swap_obj(pinterp); break;
+            case OP_SWAP_WORK: do_swap_work(pinterp); break;
+            case OP_ROT_WORK: do_rot_work(pinterp); break;
+            case OP_ROT_OBJ: do_rot_obj(pinterp); break;
+            case OP_RAND: do_rand(pinterp); break;
+            case OP_ADD: do_add(pinterp); break;
+            case OP_SUB: do_sub(pinterp); break;
+            case OP_MUL: do_mul(pinterp); break;
+            case OP_DIV: do_div(pinterp); break;
+            case OP_DUP_WORK: do_dup_work(pinterp); break;
+            case OP_DUP_OBJ: do_dup_obj(pinterp); break;
+            case OP_JUMP:
+                pword = pcode->code + pword->position;
+                break;
+            case OP_CALL:
+                push_onto_return_stack(pinterp, pword + 1 - pcode->code);
+                pword = pcode->code + pword->position;
+                break;
+            case OP_RETURN:
+                pword = pcode->code + pop_from_return_stack(pinterp);
+                break;
+            case OP_REPEAT:
+                // The counter is kept on the return stack while looping
+                count = (int) pop_from_work_stack(pinterp);
+                if (count > 0){
+                    push_onto_return_stack(pinterp, count);
+                    pword++;
+                } else {
+                    pword = pcode->code + pword->position;
+                }
+                break;
+            case OP_TIMES:
+                if (--pinterp->rstack.content[pinterp->rstack.top - 1] > 0){
+                    pword = pcode->code + pword->position;
+                } else {
+                    pop_from_return_stack(pinterp);
+                    pword++;
+                }
+                break;
+            case OP_CHECKPOINT:
+                save_checkpoint(pinterp, &pcode->pcheckpoints[(pword++)->position]);
+                break;
+        }
+    }
+}
+
+
+// Checkpoints
+// Only taken outside of words and loops, so the return stack is empty
+void save_checkpoint(Interpreter* pinterp, Checkpoint* pcheckpoint){
+    release_checkpoint(pcheckpoint);
+    pcheckpoint->seed = pinterp->seed;
+    pcheckpoint->n_work = pinterp->wstack.top;
+    pcheckpoint->n_objects = pinterp->ostack.top;
+    pcheckpoint->pwork = NULL;
+    pcheckpoint->pobjects = NULL;
+    if (pcheckpoint->n_work > 0){
+        pcheckpoint->pwork = (float*) malloc(pcheckpoint->n_work * sizeof(float));
+        check_allocation(pcheckpoint->pwork, "Couldn't allocate memory for a checkpoint\n");
+        memcpy(pcheckpoint->pwork, pinterp->wstack.content, pcheckpoint->n_work * sizeof(float));
+    }
+    if (pcheckpoint->n_objects > 0){
+        pcheckpoint->pobjects = (StackObject*) malloc(pcheckpoint->n_objects * sizeof(StackObject));
+        check_allocation(pcheckpoint->pobjects, "Couldn't allocate memory for a checkpoint\n");
+    }
+    for (int i = 0; i < pcheckpoint->n_objects; i++)
+        pcheckpoint->pobjects[i] = share_object(pinterp->ostack.content[i]);
+    pcheckpoint->saved = true;
+}
+
+void restore_checkpoint(Interpreter* pinterp, Checkpoint* pcheckpoint){
+    clear_obj_stack(pinterp);
+    pinterp->seed = pcheckpoint->seed;
+    pinterp->wstack.top = pcheckpoint->n_work;
+    if (pcheckpoint->n_work > 0)
+        memcpy(pinterp->wstack.content, pcheckpoint->pwork, pcheckpoint->n_work * sizeof(float));
+    pinterp->rstack.top = 0;
+    for (int i = 0; i < pcheckpoint->n_objects; i++)
+        push_onto_obj_stack(pinterp, share_object(pcheckpoint->pobjects[i]));
+}
+
+void release_checkpoint(Checkpoint* pcheckpoint){
+    if (!pcheckpoint->saved)
+        return;
+    for (int i = 0; i < pcheckpoint->n_objects; i++)
+        release_object(pcheckpoint->pobjects[i]);
+    free(pcheckpoint->pwork);
+    free(pcheckpoint->pobjects);
+    pcheckpoint->saved = false;
+}
+
+// Finds the last checkpoint of the new script with the same text before
+// it as in the old one. Its state is the same, so it's restored and
+// moved over, along with the ones before it. Returns where to start
+int resume_position(Interpreter* pinterp, Bytecode* pold, Bytecode* pnew){
+    int last = -1;
+    for (int i = 0; i < pold->n_checkpoints && i < pnew->n_checkpoints; i++){
+        if (pold->pcheckpoints[i].hash != pnew->pcheckpoints[i].hash ||
+            !pold->pcheckpoints[i].saved)
+            break;
+        last = i;
+    }
+    if (last < 0)
+        return 0;
+
+    for (int i = 0; i <= last; i++){
+        pnew->pcheckpoints[i] = pold->pcheckpoints[i];
+        pold->pcheckpoints[i].saved = false;
+    }
+    restore_checkpoint(pinterp, &pnew->pcheckpoints[last]);
+    printf("Resuming from line %d\n", pnew->pcheckpoints[last].line);
+    return pnew->pcheckpoints[last].position;
+}
+
+
+void push_onto_work_stack(Interpreter* pinterp, float elem){
+    if (pinterp->wstack.top >= STACK_SIZE) {
         printf("Work stack is full\n");
         exit(1);
     } else {
-        wstack.content[wstack.top++] = elem;
+        pinterp->wstack.content[pinterp->wstack.top++] = elem;
     }
 }
 
-void push_onto_obj_stack(TriangleMesh* elem){
-    if (ostack.top >= STACK_SIZE) {
+void push_onto_obj_stack(Interpreter* pinterp, StackObject elem){
+    if (pinterp->ostack.top >= STACK_SIZE) {
         printf("Object stack is full\n");
         exit(1);
     } else {
-        ostack.content[ostack.top++] = elem;
+        pinterp->ostack.content[pinterp->ostack.top++] = elem;
+    }
+}
+
+void push_onto_return_stack(Interpreter* pinterp, int elem){
+    if (pinterp->rstack.top >= STACK_SIZE) {
+        printf("Return stack is full\n");
+        exit(1);
+    } else {
+        pinterp->rstack.content[pinterp->rstack.top++] = elem;
     }
 }
 
-float pop_from_work_stack(){
-    if (wstack.top <= 0) {
+float pop_from_work_stack(Interpreter* pinterp){
+    if (pinterp->wstack.top <= 0) {
         printf("Work stack is empty\n");
         exit(1);
     } else {
-        return wstack.content[--wstack.top];
+        return pinterp->wstack.content[--pinterp->wstack.top];
     }
 }
 
-TriangleMesh* pop_from_obj_stack(){
-    if (ostack.top <= 0) {
+StackObject pop_from_obj_stack(Interpreter* pinterp){
+    if (pinterp->ostack.top <= 0) {
         printf("Object stack is empty\n");
         exit(1);
     } else {
-        return ostack.content[--ostack.top];
+        return pinterp->ostack.content[--pinterp->ostack.top];
+    }
+}
+
+int pop_from_return_stack(Interpreter* pinterp){
+    if (pinterp->rstack.top <= 0) {
+        printf("Return stack is empty\n");
+        exit(1);
+    } else {
+        return pinterp->rstack.content[--pinterp->rstack.top];
+    }
+}
+
+
+// Objects
+// Nodes are shared between objects and never modified, so copying an
+// object only takes a new reference. Transforms stay in the StackObject,
+// and flattening writes into a new mesh
+StackObject new_object(TriangleMesh* pmesh){
+    GeometryNode* pnode = (GeometryNode*) malloc(sizeof(GeometryNode));
+    check_allocation(pnode, "Couldn't allocate memory for the object\n");
+    pnode->references = 1;
+    pnode->leaf = true;
+    pnode->pmesh = pmesh;
+    pnode->queued = false;
+
+    StackObject res;
+    res.pnode = pnode;
+    res.pending = false;
+    return res;
+}
+
+// Constant time, the mesh is only built when it's needed
+StackObject new_future(Future future){
+    StackObject res = new_object(NULL);
+    res.pnode->future = future;
+    return res;
+}
+
+// Constant time, nothing is copied. The result takes over both references
+StackObject merge_objects(StackObject obj1, StackObject obj2){
+    GeometryNode* pnode = (GeometryNode*) malloc(sizeof(GeometryNode));
+    check_allocation(pnode, "Couldn't allocate memory for the object\n");
+    pnode->references = 1;
+    pnode->leaf = false;
+    pnode->pmesh = NULL;
+    pnode->queued = false;
+    pnode->left = obj1;
+    pnode->right = obj2;
+
+    StackObject res;
+    res.pnode = pnode;
+    res.pending = false;
+    return res;
+}
+
+// Constant time, the copy shares the geometry
+StackObject share_object(StackObject obj){
+    obj.pnode->references += 1;
+    return obj;
+}
+
+// Drops a reference, and frees what isn't used anymore
+void release_object(StackObject obj){
+    GeometryNode* pnode;
+    GeometryNode* pstack[STACK_SIZE];
+    GeometryNode** ppending = pstack;
+    int n_pending = 1,
+        capacity = STACK_SIZE;
+    ppending[0] = obj.pnode;
+
+    // Without recursion since merge chains can be very long
+    while (n_pending > 0){
+        pnode = ppending[--n_pending];
+        pnode->references -= 1;
+        if (pnode->references > 0)
+            continue;
+
+        if (pnode->leaf){
+            if (pnode->pmesh != NULL)
+                free_triangle_mesh(pnode->pmesh);
+        } else {
+            if (n_pending + 2 > capacity){
+                capacity *= 2;
+                if (ppending == pstack){
+                    ppending = (GeometryNode**) malloc(capacity * sizeof(GeometryNode*));
+                    check_allocation(ppending, "Couldn't allocate memory for freeing\n");
+                    memcpy(ppending, pstack, sizeof(pstack));
+                } else {
+                    ppending = realloc(ppending, capacity * sizeof(GeometryNode*));
+                    check_allocation(ppending, "Couldn't allocate memory for freeing\n");
+                }
+            }
+            ppending[n_pending++] = pnode->left.pnode;
+            ppending[n_pending++] = pnode->right.pnode;
+        }
+        free(pnode);
+    }
+    if (ppending != pstack)
+        free(ppending);
+}
+
+void clear_obj_stack(Interpreter* pinterp){
+    while (pinterp->ostack.top > 0)
+        release_object(pop_from_obj_stack(pinterp));
+}
+
+// Adds a transform after the ones already pending
+void transform_object(StackObject* pobj, float* matrix){
+    if (pobj->pending){
+        multiply_matrix(pobj->transform, matrix);
+    } else {
+        memcpy(pobj->transform, matrix, 16 * sizeof(float));
+        pobj->pending = true;
+    }
+}
+
+// Puts a child's transform under its parent's
+FlattenTask child_task(FlattenTask* pparent, StackObject* pchild){
+    FlattenTask res;
+    res.pnode = pchild->pnode;
+    res.pending = pparent->pending || pchild->pending;
+    if (pchild->pending){
+        memcpy(res.transform, pchild->transform, 16 * sizeof(float));
+        if (pparent->pending)
+            multiply_matrix(res.transform, pparent->transform);
+    } else if (pparent->pending){
+        memcpy(res.transform, pparent->transform, 16 * sizeof(float));
+    }
+    return res;
+}
+
+// Turns the object into a single mesh, applying all pending transforms.
+// Every vertex is read and written once, whatever the number of merges.
+// The mesh can be shared with other objects, it must not be modified
+TriangleMesh* materialize(Interpreter* pinterp, StackObject* pobj){
+    GeometryNode* proot = pobj->pnode;
+    if (proot->leaf && proot->pmesh == NULL){
+        Arena* parena = worker_arenas(pinterp);
+        proot->pmesh = build_future(&proot->future, parena);
+        reset_arena(parena);
+    }
+    if (proot->leaf && !pobj->pending)
+        return proot->pmesh;
+
+    if (proot->leaf && proot->references == 1){
+        // Nobody else uses it, transformed in place
+        apply_transform(pobj->transform, proot->pmesh);
+        pobj->pending = false;
+        return proot->pmesh;
+    }
+
+    // First list the leaves, depth first, left before right, and the
+    // futures that have to be built. Without recursion since merge chains
+    // can be very long
+    FlattenJob job = {NULL, 0, 0, NULL, 0, 0, NULL, worker_arenas(pinterp)};
+    int leaves_capacity = 64,
+        futures_capacity = 16,
+        capacity = 64,
+        n_tasks = 1;
+    FlattenTask* ptasks = (FlattenTask*) malloc(capacity * sizeof(FlattenTask));
+    job.pleaves = (FlattenTask*) malloc(leaves_capacity * sizeof(FlattenTask));
+    job.pfutures = (GeometryNode**) malloc(futures_capacity * sizeof(GeometryNode*));
+    if (ptasks == NULL || job.pleaves == NULL || job.pfutures == NULL){
+        printf("Couldn't allocate memory for flattening\n");
+        exit(1);
+    }
+    ptasks[0].pnode = proot;
+    ptasks[0].pending = pobj->pending;
+    if (pobj->pending)
+        memcpy(ptasks[0].transform, pobj->transform, 16 * sizeof(float));
+
+    FlattenTask task;
+    while (n_tasks > 0){
+        task = ptasks[--n_tasks];
+        if (task.pnode->leaf){
+            if (job.n_leaves >= leaves_capacity){
+                leaves_capacity *= 2;
+                job.pleaves = realloc(job.pleaves, leaves_capacity * sizeof(FlattenTask));
+                check_allocation(job.pleaves, "Couldn't allocate memory for flattening\n");
+            }
+            job.pleaves[job.n_leaves++] = task;
+
+            if (task.pnode->pmesh == NULL && !task.pnode->queued){
+                if (job.n_futures >= futures_capacity){
+                    futures_capacity *= 2;
+                    job.pfutures = realloc(job.pfutures, futures_capacity * sizeof(GeometryNode*));
+                    check_allocation(job.pfutures, "Couldn't allocate memory for flattening\n");
+                }
+                task.pnode->queued = true;
+                job.pfutures[job.n_futures++] = task.pnode;
+            }
+        } else {
+            if (n_tasks + 2 > capacity){
+                capacity *= 2;
+                ptasks = realloc(ptasks, capacity * sizeof(FlattenTask));
+                check_allocation(ptasks, "Couldn't allocate memory for flattening\n");
+            }
+            ptasks[n_tasks++] = child_task(&task, &task.pnode->right);
+            ptasks[n_tasks++] = child_task(&task, &task.pnode->left);
+        }
+    }
+    free(ptasks);
+
+    // Build the primitives, then place every leaf in the result now that
+    // their sizes are known, then copy them
+    run_on_workers(flatten_worker, &job);
+    job.next_leaf = 0;
+
+    int n_vertices = 0,
+        size = 0;
+    for (int i = 0; i < job.n_leaves; i++){
+        job.pleaves[i].first_vertex = n_vertices;
+        job.pleaves[i].first_triangle = size;
+        n_vertices += job.pleaves[i].pnode->pmesh->n_vertices;
+        size += job.pleaves[i].pnode->pmesh->size;
+    }
+    job.pres = new_triangle_mesh(n_vertices, size);
+    run_on_workers(flatten_worker, &job);
+    job.pres->n_vertices = n_vertices;
+    job.pres->size = size;
+
+    free(job.pleaves);
+    free(job.pfutures);
+    release_object(*pobj);
+    *pobj = new_object(job.pres);
+    return job.pres;
+}
+
+// Builds the futures if the result isn't allocated yet, copies the leaves
+// otherwise
+void flatten_worker(void* pdata, int worker){
+    FlattenJob* pjob = (FlattenJob*) pdata;
+    int start, end;
+
+    if (pjob->pres == NULL){
+        Arena* parena = &pjob->parenas[worker];
+        while (next_chunk(&pjob->next_future, FUTURE_CHUNK, pjob->n_futures, &start, &end)){
+            for (int i = start; i < end; i++){
+                pjob->pfutures[i]->pmesh = build_future(&pjob->pfutures[i]->future, parena);
+                reset_arena(parena);
+            }
+        }
+        return;
+    }
+
+    FlattenTask* pleaf;
+    while (next_chunk(&pjob->next_leaf, LEAF_CHUNK, pjob->n_leaves, &start, &end)){
+        for (int i = start; i < end; i++){
+            pleaf = &pjob->pleaves[i];
+            copy_transformed_mesh(pjob->pres, pleaf->pnode->pmesh,
+                                  pleaf->pending ? pleaf->transform : NULL,
+                                  pleaf->first_vertex, pleaf->first_triangle);
+        }
+    }
+}
+
+TriangleMesh* build_future(Future* pfuture, Arena* parena){
+    float* params = pfuture->params;
+    if (pfuture->primitive == OP_BOX)
+        return box(params[0], params[1], params[2]);
+
+    // The polygon is only needed until the prism is built
+    Polygon* ppoly = new_regular_polygon(params[0], (int) params[1], parena);
+    return prism(ppoly, params[2]);
+}
+
+// Scratch memory for each worker, kept between evaluations
+Arena* worker_arenas(Interpreter* pinterp){
+    int n_workers = worker_count();
+    if (pinterp->n_arenas < n_workers){
+        pinterp->parenas = realloc(pinterp->parenas, n_workers * sizeof(Arena));
+        check_allocation(pinterp->parenas, "Couldn't allocate memory for the workers\n");
+        for (int i = pinterp->n_arenas; i < n_workers; i++)
+            init_arena(&pinterp->parenas[i], ARENA_BLOCK_SIZE);
+        pinterp->n_arenas = n_workers;
+    }
+    return pinterp->parenas;
+}
+
+// Gives the object's geometry as a mesh the caller owns
+TriangleMesh* take_mesh(Interpreter* pinterp, StackObject* pobj){
+    TriangleMesh* pres = materialize(pinterp, pobj);
+    if (pobj->pnode->references > 1){
+        pres = copy_mesh(pres);
+        release_object(*pobj);
+    } else {
+        free(pobj->pnode);
+    }
+    return pres;
+}
+
+
+// Primitive cache
+// Direct mapped, a new primitive replaces the one in its slot. A hit
+// shares the node, so each set of parameters is built at most once
+StackObject primitive_object(Interpreter* pinterp, Future future){
+    uint32_t bits;
+    uint32_t hash = 2166136261u ^ future.primitive;
+    for (int i = 0; i < 3; i++){
+        memcpy(&bits, &future.params[i], sizeof(bits));
+        hash = (hash ^ bits) * 16777619u;
+    }
+    GeometryNode** pslot = &pinterp->primitive_cache[(hash ^ (hash >> 16)) & (PRIMITIVE_CACHE_SIZE - 1)];
+
+    StackObject res;
+    if (*pslot != NULL && (*pslot)->future.primitive == future.primitive &&
+        memcmp((*pslot)->future.params, future.params, sizeof(future.params)) == 0){
+        pinterp->cache_hits++;
+        res.pnode = *pslot;
+        res.pending = false;
+        return share_object(res);
+    }
+
+    pinterp->cache_misses++;
+    res = new_future(future);
+    if (*pslot != NULL){
+        StackObject old = {*pslot};
+        release_object(old);
+    }
+    *pslot = share_object(res).pnode;
+    return res;
+}
+
+void clear_primitive_cache(Interpreter* pinterp){
+    StackObject obj;
+    for (int i = 0; i < PRIMITIVE_CACHE_SIZE; i++){
+        if (pinterp->primitive_cache[i] != NULL){
+            obj.pnode = pinterp->primitive_cache[i];
+            release_object(obj);
+            pinterp->primitive_cache[i] = NULL;
+        }
     }
 }
 
-void do_box(){
-    float c = pop_from_work_stack();
-    float b = pop_from_work_stack();
-    float a = pop_from_work_stack();
-    TriangleMesh* pbox = box(a, b, c);
-    push_onto_obj_stack(pbox);
+
+// Instructions
+void do_box(Interpreter* pinterp){
+    float c = pop_from_work_stack(pinterp);
+    float b = pop_from_work_stack(pinterp);
+    float a = pop_from_work_stack(pinterp);
+    Future future = {OP_BOX, {a, b, c}};
+    push_onto_obj_stack(pinterp, primitive_object(pinterp, future));
 }
 
-void do_rotate(){
-    float z = pop_from_work_stack();
-    float y = pop_from_work_stack();
-    float x = pop_from_work_stack();
+void do_rotate(Interpreter* pinterp){
+    float z = pop_from_work_stack(pinterp);
+    float y = pop_from_work_stack(pinterp);
+    float x = pop_from_work_stack(pinterp);
     Point3D rotation = {deg_to_rad(x), deg_to_rad(y), deg_to_rad(z)};
-    TriangleMesh* mesh = pop_from_obj_stack();
-    rotate_mesh(mesh, rotation);
-    push_onto_obj_stack(mesh);
+    float matrix[16];
+    calculate_rotation_matrix(matrix, rotation);
+    StackObject obj = pop_from_obj_stack(pinterp);
+    transform_object(&obj, matrix);
+    push_onto_obj_stack(pinterp, obj);
 }
 
-void do_translate(){
-    float z = pop_from_work_stack();
-    float y = pop_from_work_stack();
-    float x = pop_from_work_stack();
+void do_translate(Interpreter* pinterp){
+    float z = pop_from_work_stack(pinterp);
+    float y = pop_from_work_stack(pinterp);
+    float x = pop_from_work_stack(pinterp);
     Point3D translation = {x, y, z};
-    TriangleMesh* mesh = pop_from_obj_stack();
-    translate_mesh(mesh, translation);
-    push_onto_obj_stack(mesh);
+    float matrix[16];
+    calculate_translation_matrix(matrix, translation);
+    StackObject obj = pop_from_obj_stack(pinterp);
+    transform_object(&obj, matrix);
+    push_onto_obj_stack(pinterp, obj);
 }
 
-void do_prism(){
-    float height = pop_from_work_stack();
-    int n_size = (int) pop_from_work_stack();
-    float radius = pop_from_work_stack();
-    Polygon* ppoly = new_regular_polygon(radius, n_size);
-    TriangleMesh* mesh = prism(ppoly, height);
-    push_onto_obj_stack(mesh);
-    free(ppoly);
+void do_prism(Interpreter* pinterp){
+    float height = pop_from_work_stack(pinterp);
+    int n_size = (int) pop_from_work_stack(pinterp);
+    float radius = pop_from_work_stack(pinterp);
+    Future future = {OP_PRISM, {radius, (float) n_size, height}};
+    push_onto_obj_stack(pinterp, primitive_object(pinterp, future));
 }
 
-void do_merge(){
-    TriangleMesh* mesh1 = pop_from_obj_stack();
-    TriangleMesh* mesh2 = pop_from_obj_stack();
-    mesh1 = merge_tri_meshes(mesh1, mesh2);
-    push_onto_obj_stack(mesh1);
+void do_merge(Interpreter* pinterp){
+    StackObject obj1 = pop_from_obj_stack(pinterp);
+    StackObject obj2 = pop_from_obj_stack(pinterp);
+    push_onto_obj_stack(pinterp, merge_objects(obj1, obj2));
 }
 
-void do_clone(){
-    TriangleMesh* mesh1 = pop_from_obj_stack();
-    TriangleMesh* mesh2 = copy_mesh(mesh1);
-    push_onto_obj_stack(mesh1);
-    push_onto_obj_stack(mesh2);
+void do_clone(Interpreter* pinterp){
+    // Both share the geometry until one of them is flattened
+    StackObject obj1 = pop_from_obj_stack(pinterp);
+    StackObject obj2 = share_object(obj1);
+    push_onto_obj_stack(pinterp, obj1);
+    push_onto_obj_stack(pinterp, obj2);
 }
 
-void do_swap_obj(){
-    TriangleMesh* mesh1 = pop_from_obj_stack();
-    TriangleMesh* mesh2 = pop_from_obj_stack();
-    push_onto_obj_stack(mesh1);
-    push_onto_obj_stack(mesh2);
+void do_swap_obj(Interpreter* pinterp){
+    StackObject obj1 = pop_from_obj_stack(pinterp);
+    StackObject obj2 = pop_from_obj_stack(pinterp);
+    push_onto_obj_stack(pinterp, obj1);
+    push_onto_obj_stack(pinterp, obj2);
 }
 
-void do_swap_work(){
-    float n1 = pop_from_work_stack();
-    float n2 = pop_from_work_stack();
-    push_onto_work_stack(n1);
-    push_onto_work_stack(n2);
+void do_swap_work(Interpreter* pinterp){
+    float n1 = pop_from_work_stack(pinterp);
+    float n2 = pop_from_work_stack(pinterp);
+    push_onto_work_stack(pinterp, n1);
+    push_onto_work_stack(pinterp, n2);
 }
 
-void do_rot_work(){
-    float n1 = pop_from_work_stack();
-    float n2 = pop_from_work_stack();
-    float n3 = pop_from_work_stack();
-    push_onto_work_stack(n1);
-    push_onto_work_stack(n3);
-    push_onto_work_stack(n2);
+void do_rot_work(Interpreter* pinterp){
+    float n1 = pop_from_work_stack(pinterp);
+    float n2 = pop_from_work_stack(pinterp);
+    float n3 = pop_from_work_stack(pinterp);
+    push_onto_work_stack(pinterp, n1);
+    push_onto_work_stack(pinterp, n3);
+    push_onto_work_stack(pinterp, n2);
 }
 
-void do_rot_obj(){
-    TriangleMesh* mesh1 = pop_from_obj_stack();
-    TriangleMesh* mesh2 = pop_from_obj_stack();
-    TriangleMesh* mesh3 = pop_from_obj_stack();
-    push_onto_obj_stack(mesh1);
-    push_onto_obj_stack(mesh3);
-    push_onto_obj_stack(mesh2);
+void do_rot_obj(Interpreter* pinterp){
+    StackObject obj1 = pop_from_obj_stack(pinterp);
+    StackObject obj2 = pop_from_obj_stack(pinterp);
+    StackObject obj3 = pop_from_obj_stack(pinterp);
+    push_onto_obj_stack(pinterp, obj1);
+    push_onto_obj_stack(pinterp, obj3);
+    push_onto_obj_stack(pinterp, obj2);
 }
 
-void do_rand(){
-    float max = pop_from_work_stack();
-    float min = pop_from_work_stack();
-    float res = min + ((float) rand() / (float) (RAND_MAX / (max - min)));
-    push_onto_work_stack(res);
+void do_rand(Interpreter* pinterp){
+    float max = pop_from_work_stack(pinterp);
+    float min = pop_from_work_stack(pinterp);
+    float res = min + ((float) rand_r(&pinterp->seed) / (float) (RAND_MAX / (max - min)));
+    push_onto_work_stack(pinterp, res);
 }
 
-void do_add(){
-    float b = pop_from_work_stack();
-    float a = pop_from_work_stack();
-    push_onto_work_stack(a + b);
+void do_add(Interpreter* pinterp){
+    float b = pop_from_work_stack(pinterp);
+    float a = pop_from_work_stack(pinterp);
+    push_onto_work_stack(pinterp, a + b);
 }
 
-void do_sub(){
-    float b = pop_from_work_stack();
-    float a = pop_from_work_stack();
-    push_onto_work_stack(a - b);
+void do_sub(Interpreter* pinterp){
+    float b = pop_from_work_stack(pinterp);
+    float a = pop_from_work_stack(pinterp);
+    push_onto_work_stack(pinterp, a - b);
 }
 
-void do_mul(){
-    float b = pop_from_work_stack();
-    float a = pop_from_work_stack();
-    push_onto_work_stack(b * a);
+void do_mul(Interpreter* pinterp){
+    float b = pop_from_work_stack(pinterp);
+    float a = pop_from_work_stack(pinterp);
+    push_onto_work_stack(pinterp, b * a);
 }
 
-void do_div(){
-    float b = pop_from_work_stack();
-    float a = pop_from_work_stack();
-    push_onto_work_stack(a / b);
+void do_div(Interpreter* pinterp){
+    float b = pop_from_work_stack(pinterp);
+    float a = pop_from_work_stack(pinterp);
+    push_onto_work_stack(pinterp, a / b);
 }
 
-void do_dup_work(){
-    float a = pop_from_work_stack();
-    push_onto_work_stack(a);
-    push_onto_work_stack(a);
+void do_dup_work(Interpreter* pinterp){
+    float a = pop_from_work_stack(pinterp);
+    push_onto_work_stack(pinterp, a);
+    push_onto_work_stack(pinterp, a);
 }
 
-void do_dup_obj(){
-    TriangleMesh* a = pop_from_obj_stack();
-    push_onto_obj_stack(a);
-    push_onto_obj_stack(a);
+void do_dup_obj(Interpreter* pinterp){
+    // Same as clone, transforming one of them doesn't change the other
+    StackObject a = pop_from_obj_stack(pinterp);
+    push_onto_obj_stack(pinterp, a);
+    push_onto_obj_stack(pinterp, share_object(a));
 }
 
-void do_reflect(){
-    float z = pop_from_work_stack();
-    float y = pop_from_work_stack();
-    float x = pop_from_work_stack();
+void do_reflect(Interpreter* pinterp){
+    float z = pop_from_work_stack(pinterp);
+    float y = pop_from_work_stack(pinterp);
+    float x = pop_from_work_stack(pinterp);
     Point3D normal = {x, y, z};
-    TriangleMesh* mesh = pop_from_obj_stack();
-    reflect_mesh(mesh, normal);
-    push_onto_obj_stack(mesh);
+    float matrix[16];
+    calculate_reflection_matrix(matrix, normal);
+    StackObject obj = pop_from_obj_stack(pinterp);
+    transform_object(&obj, matrix);
+    push_onto_obj_stack(pinterp, obj);
 }
@@ -2,15 +2,106 @@
 #define INTERPRETER_H
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include "primitives.h"
+#include "arena.h"
 
 #define STACK_SIZE 512
 #define INPUT_FILE "my_code"
-#define BUFFER_SIZE 512
+#define CHUNK_SIZE (1 << 20) // Read at once when the script can't be mapped
+#define NUMBER_SIZE 128 // Numbers shorter than this are parsed without allocating
+#define KEYWORD_TABLE_SIZE 32
+#define ARENA_BLOCK_SIZE (64 * 1024) // Scratch memory for building primitives
+#define PRIMITIVE_CACHE_SIZE 256 // Power of two
+#define FUTURE_CHUNK 4 // Primitives built at once by a worker
+#define LEAF_CHUNK 64 // Meshes copied at once by a worker when flattening
+
+typedef enum {
+    OP_PUSH, // Followed by the number to push
+    OP_BOX,
+    OP_PRISM,
+    OP_ROTATE,
+    OP_TRANSLATE,
+    OP_REFLECT,
+    OP_MERGE,
+    OP_CLONE,
+    OP_SWAP_OBJ,
+    OP_SWAP_WORK,
+    OP_ROT_WORK,
+    OP_ROT_OBJ,
+    OP_RAND,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_DUP_WORK,
+    OP_DUP_OBJ,
+    OP_JUMP,    // Followed by the position to jump to
+    OP_CALL,    // Followed by the position of the word
+    OP_RETURN,
+    OP_REPEAT,  // Followed by the position after the loop
+    OP_TIMES,   // Followed by the position of the loop's body
+    OP_CHECKPOINT, // Followed by the checkpoint's index
+} Opcode;
+
+typedef struct _gn GeometryNode;
+
+// A primitive that hasn't been built yet. They are built all at once, on
+// the workers, when the geometry is first needed
+typedef struct {
+    Opcode primitive;   // OP_BOX or OP_PRISM
+    float params[3];
+} Future;
+
+// An object and the transforms that haven't been applied to it yet.
+// They are accumulated in a single matrix, and only applied when the
+// vertices are needed
+typedef struct {
+    GeometryNode* pnode;
+    float transform[16];
+    bool pending;       // False if transform is the identity
+} StackObject;
+
+// Geometry of an object, as a rope: leaves hold a mesh, other nodes are
+// the merge of two objects. Merging is only copied into a single mesh
+// once, when the whole object is needed. Nodes can be shared by several
+// objects, and are never modified once created, apart from filling in
+// their future
+struct _gn {
+    int references;
+    bool leaf;
+    TriangleMesh* pmesh;        // NULL until the future is built
+    Future future;
+    bool queued;                // Future already waiting to be built
+    StackObject left, right;    // Merged objects, left's triangles come first
+};
+
+// Subtree still to be copied during flattening, with the transforms of
+// all its parents
+typedef struct {
+    GeometryNode* pnode;
+    float transform[16];
+    bool pending;
+    int first_vertex, first_triangle; // Where a leaf goes in the result
+} FlattenTask;
+
+// Work shared by the workers while flattening
+typedef struct {
+    GeometryNode** pfutures;
+    int n_futures;
+    int next_future;
+    FlattenTask* pleaves;
+    int n_leaves;
+    int next_leaf;
+    TriangleMesh* pres;
+    Arena* parenas;
+} FlattenJob;
 
 typedef struct {
     int top;
-    TriangleMesh* content[STACK_SIZE];
+    StackObject content[STACK_SIZE];
 } ObjectStack;
 
 typedef struct {
@@ -18,34 +109,166 @@ typedef struct {
     float content[STACK_SIZE];
 } WorkStack;
 
-static const char* delimiter = " \n";
+// Return addresses of the words being run, and counters of the loops
+typedef struct {
+    int top;
+    int content[STACK_SIZE];
+} ReturnStack;
+
+typedef union {
+    Opcode opcode;
+    float value;
+    int position;
+} BytecodeWord;
+
+// State at the start of a line, so that a reload can resume from there if
+// the script didn't change before it. Objects are shared, not copied
+typedef struct {
+    int position;       // In the bytecode, right after the checkpoint
+    int line;
+    uint64_t hash;      // Of the script's text before the line
+    bool saved;
+    unsigned int seed;
+    int n_work, n_objects;
+    float* pwork;
+    StackObject* pobjects;
+} Checkpoint;
+
+// A compiled script
+typedef struct {
+    int size, capacity;
+    BytecodeWord* code;
+    int n_checkpoints, checkpoints_capacity;
+    Checkpoint* pcheckpoints;
+} Bytecode;
+
+typedef struct {
+    const char* name;
+    Opcode opcode;
+} Keyword;
+
+// Part of the script's text, not NUL-terminated
+typedef struct {
+    const char* start;
+    size_t length;
+} Token;
+
+// User-defined word
+typedef struct {
+    Token name;
+    int start;
+} Word;
+
+// What is needed while compiling a script, on top of the bytecode
+typedef struct {
+    Bytecode* pcode;
+    Word* pwords;
+    int n_words, words_capacity;
+    int loops[STACK_SIZE];  // Positions to fill once the loops are closed
+    int n_loops;
+    bool naming;            // Next token is the name of a new word
+    bool defining;
+    Token definition_name;
+    int definition_jump;    // Position to fill once the word is finished
+} Compiler;
+
+// Whole text of a script, mapped or read into memory
+typedef struct {
+    const char* text;
+    size_t size;
+    bool mapped;
+} ScriptSource;
+
+// Everything needed to evaluate a script. Separate interpreters don't
+// share anything, and can run on different threads
+typedef struct {
+    WorkStack wstack;
+    ObjectStack ostack;
+    ReturnStack rstack;
+    unsigned int id;
+    unsigned int seed;      // For rand_r
+    Arena* parenas;         // Scratch memory for building primitives, one per worker
+    int n_arenas;
+    Bytecode* pcode;        // Compiled script, kept until the file changes
+    struct stat code_stat;  // File it was compiled from
+    // Primitives already made, shared by every object that uses them.
+    // Holding a reference means their mesh is never modified. Kept
+    // between evaluations, NULL for empty slots
+    GeometryNode* primitive_cache[PRIMITIVE_CACHE_SIZE];
+    int cache_hits, cache_misses; // During the last evaluation
+} Interpreter;
+
+Interpreter* new_interpreter();
+void free_interpreter(Interpreter* pinterp);
+TriangleMesh* mesh_from_file(Interpreter* pinterp, FILE* pfile);
+void push_onto_work_stack(Interpreter* pinterp, float elem);
+void push_onto_obj_stack(Interpreter* pinterp, StackObject elem);
+void push_onto_return_stack(Interpreter* pinterp, int elem);
+float pop_from_work_stack(Interpreter* pinterp);
+StackObject pop_from_obj_stack(Interpreter* pinterp);
+int pop_from_return_stack(Interpreter* pinterp);
+
+// Objects
+StackObject new_object(TriangleMesh* pmesh);
+StackObject new_future(Future future);
+StackObject merge_objects(StackObject obj1, StackObject obj2);
+StackObject share_object(StackObject obj);
+void release_object(StackObject obj);
+void clear_obj_stack(Interpreter* pinterp);
+void transform_object(StackObject* pobj, float* matrix);
+TriangleMesh* materialize(Interpreter* pinterp, StackObject* pobj);
+TriangleMesh* take_mesh(Interpreter* pinterp, StackObject* pobj);
+Arena* worker_arenas(Interpreter* pinterp);
+TriangleMesh* build_future(Future* pfuture, Arena* parena);
+void flatten_worker(void* pdata, int worker);
+
+// Primitive cache
+StackObject primitive_object(Interpreter* pinterp, Future future);
+void clear_primitive_cache(Interpreter* pinterp);
+
+// Tokenizing
+void open_source(FILE* pfile, ScriptSource* psource);
+void close_source(ScriptSource* psource);
+bool next_token(const char** pcursor, const char* end, Token* ptoken);
+
+// Compilation
+Bytecode* compile_script(FILE* pfile);
+void compile_token(Compiler* pcompiler, Token token);
+bool compile_control(Compiler* pcompiler, Token token);
+void emit(Bytecode* pcode, BytecodeWord word);
+int emit_position(Bytecode* pcode, int position);
+const Keyword* find_keyword(const char* token, size_t length);
+const Word* find_word(Compiler* pcompiler, Token token);
+bool token_is(Token token, const char* name);
+void add_checkpoint(Compiler* pcompiler, uint64_t hash, int line);
+uint64_t hash_text(uint64_t hash, const char* start, const char* end);
+void free_bytecode(Bytecode* pcode);
+void run_bytecode(Interpreter* pinterp, Bytecode* pcode, int start);
 
-TriangleMesh* mesh_from_file(FILE* pfile);
-void push_onto_work_stack(float elem);
-void push_onto_obj_stack(TriangleMesh* elem);
-float pop_from_work_stack();
-TriangleMesh* pop_from_obj_stack();
-void parse_token(char* token);
-void parse_instruction(char* token);
+// Checkpoints
+void save_checkpoint(Interpreter* pinterp, Checkpoint* pcheckpoint);
+void restore_checkpoint(Interpreter* pinterp, Checkpoint* pcheckpoint);
+void release_checkpoint(Checkpoint* pcheckpoint);
+int resume_position(Interpreter* pinterp, Bytecode* pold, Bytecode* pnew);
 
 // Instructions
-void do_box();
-void do_prism();
-void do_rotate();
-void do_translate();
-void do_reflect();
-void do_merge();
-void do_clone();
-void do_swap_obj();
-void do_swap_work();
-void do_rot_work();
-void do_rot_obj();
-void do_rand();
-void do_add();
-void do_sub();
-void do_mul();
-void do_div();
-void do_dup_work();
-void do_dup_obj();
+void do_box(Interpreter* pinterp);
+void do_prism(Interpreter* pinterp);
+void do_rotate(Interpreter* pinterp);
+void do_translate(Interpreter* pinterp);
+void do_reflect(Interpreter* pinterp);
+void do_merge(Interpreter* pinterp);
+void do_clone(Interpreter* pinterp);
+void do_swap_obj(Interpreter* pinterp);
+void do_swap_work(Interpreter* pinterp);
+void do_rot_work(Interpreter* pinterp);
+void do_rot_obj(Interpreter* pinterp);
+void do_rand(Interpreter* pinterp);
+void do_add(Interpreter* pinterp);
+void do_sub(Interpreter* pinterp);
+void do_mul(Interpreter* pinterp);
+void do_div(Interpreter* pinterp);
+void do_dup_work(Interpreter* pinterp);
+void do_dup_obj(Interpreter* pinterp);
 
 #endif
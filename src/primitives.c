@@ -7,107 +7,101 @@
 #include "utils.h"
 #include "vect.h"
 
-TriangleMesh* new_triangle_mesh(int size){
-    TriangleMesh* pres = (TriangleMesh*) malloc(sizeof(TriangleMesh) +
-                                                size * sizeof(Triangle));
+// Creates an empty mesh with room for n_vertices vertices and size triangles
+TriangleMesh* new_triangle_mesh(int n_vertices, int size){
+    TriangleMesh* pres = (TriangleMesh*) malloc(sizeof(TriangleMesh));
     check_allocation(pres, "Couldn\'t allocate memory for the mesh\n");
+    pres->n_vertices = 0;
     pres->size = 0;
+    pres->vertex_capacity = 0;
+    pres->capacity = 0;
+    pres->vertices.x = NULL;
+    pres->vertices.y = NULL;
+    pres->vertices.z = NULL;
+    pres->indices = NULL;
+    pres->visible = NULL;
+    reserve_mesh(pres, n_vertices, size);
     return pres;
 }
 
+void free_triangle_mesh(TriangleMesh* pmesh){
+    free(pmesh->vertices.x);
+    free(pmesh->vertices.y);
+    free(pmesh->vertices.z);
+    free(pmesh->indices);
+    free(pmesh->visible);
+    free(pmesh);
+}
+
+Point3D get_vertex(VertexArray vertices, int i){
+    Point3D res = {
+        vertices.x[i],
+        vertices.y[i],
+        vertices.z[i]
+    };
+    return res;
+}
+
+Triangle get_triangle(TriangleMesh* pmesh, int i){
+    Triangle res = {
+        get_vertex(pmesh->vertices, pmesh->indices[3*i]),
+        get_vertex(pmesh->vertices, pmesh->indices[3*i + 1]),
+        get_vertex(pmesh->vertices, pmesh->indices[3*i + 2])
+    };
+    return res;
+}
+
 TriangleMesh* box(float a, float b, float c){
-    TriangleMesh* pres = (TriangleMesh*) malloc(sizeof(TriangleMesh) + 12 * sizeof(Triangle));
-    pres->size = 12;
-
-    Point3D pt_a = {0, 0, 0};
-    Point3D pt_b = {a, 0, 0};
-    Point3D pt_c = {a, b, 0};
-    Point3D pt_d = {0, b, 0};
-    Point3D pt_e = {0, 0, c};
-    Point3D pt_f = {a, 0, c};
-    Point3D pt_g = {a, b, c};
-    Point3D pt_h = {0, b, c};
-
-    Triangle abc = {pt_b, pt_a, pt_c};
-    Triangle cda = {pt_d, pt_c, pt_a};
-
-    Triangle bfg = {pt_f, pt_b, pt_g};
-    Triangle gcb = {pt_c, pt_g, pt_b};
-
-    Triangle cgh = {pt_g, pt_c, pt_h};
-    Triangle hdc = {pt_d, pt_h, pt_c};
-
-    Triangle ead = {pt_a, pt_e, pt_d};
-    Triangle dhe = {pt_h, pt_d, pt_e};
-
-    Triangle feh = {pt_e, pt_f, pt_h};
-    Triangle hgf = {pt_g, pt_h, pt_f};
-
-    Triangle efb = {pt_f, pt_e, pt_b};
-    Triangle bae = {pt_a, pt_b, pt_e};
-
-    pres->triangles[0] = abc;
-    pres->triangles[0].visible[0] = true;
-    pres->triangles[0].visible[1] = false;
-    pres->triangles[0].visible[2] = true;
-    pres->triangles[1] = cda;
-    pres->triangles[1].visible[0] = true;
-    pres->triangles[1].visible[1] = false;
-    pres->triangles[1].visible[2] = true;
-
-    pres->triangles[2] = bfg;
-    pres->triangles[2].visible[0] = true;
-    pres->triangles[2].visible[1] = false;
-    pres->triangles[2].visible[2] = true;
-    pres->triangles[3] = gcb;
-    pres->triangles[3].visible[0] = true;
-    pres->triangles[3].visible[1] = false;
-    pres->triangles[3].visible[2] = true;
-
-    pres->triangles[4] = cgh;
-    pres->triangles[4].visible[0] = true;
-    pres->triangles[4].visible[1] = false;
-    pres->triangles[4].visible[2] = true;
-    pres->triangles[5] = hdc;
-    pres->triangles[5].visible[0] = true;
-    pres->triangles[5].visible[1] = false;
-    pres->triangles[5].visible[2] = true;
-
-    pres->triangles[6] = ead;
-    pres->triangles[6].visible[0] = true;
-    pres->triangles[6].visible[1] = false;
-    pres->triangles[6].visible[2] = true;
-    pres->triangles[7] = dhe;
-    pres->triangles[7].visible[0] = true;
-    pres->triangles[7].visible[1] = false;
-    pres->triangles[7].visible[2] = true;
-
-    pres->triangles[8] = feh;
-    pres->triangles[8].visible[0] = true;
-    pres->triangles[8].visible[1] = false;
-    pres->triangles[8].visible[2] = true;
-    pres->triangles[9] = hgf;
-    pres->triangles[9].visible[0] = true;
-    pres->triangles[9].visible[1] = false;
-    pres->triangles[9].visible[2] = true;
-
-    pres->triangles[10] = efb;
-    pres->triangles[10].visible[0] = true;
-    pres->triangles[10].visible[1] = false;
-    pres->triangles[10].visible[2] = true;
-    pres->triangles[11] = bae;
-    pres->triangles[11].visible[0] = true;
-    pres->triangles[11].visible[1] = false;
-    pres->triangles[11].visible[2] = true;
+    TriangleMesh* pres = new_triangle_mesh(8, 12);
+
+    Point3D corners[8] = {
+        {0, 0, 0}, // A
+        {a, 0, 0}, // B
+        {a, b, 0}, // C
+        {0, b, 0}, // D
+        {0, 0, c}, // E
+        {a, 0, c}, // F
+        {a, b, c}, // G
+        {0, b, c}, // H
+    };
+    for (int i = 0; i < 8; i++)
+        add_vertex(pres, corners[i]);
+
+    // Two triangles per face, the diagonal (BC) is hidden
+    int faces[12][3] = {
+        {1, 0, 2}, // abc
+        {3, 2, 0}, // cda
+        {5, 1, 6}, // bfg
+        {2, 6, 1}, // gcb
+        {6, 2, 7}, // cgh
+        {3, 7, 2}, // hdc
+        {0, 4, 3}, // ead
+        {7, 3, 4}, // dhe
+        {4, 5, 7}, // feh
+        {6, 7, 5}, // hgf
+        {5, 4, 1}, // efb
+        {0, 1, 4}, // bae
+    };
+    for (int i = 0; i < 12; i++)
+        add_triangle(pres, faces[i][0], faces[i][1], faces[i][2], EDGE_AB | EDGE_CA);
 
     return pres;
 }
 
-Polygon* new_polygon(Point2D* vertices, int size){
-    Polygon* pres = (Polygon*) malloc(sizeof(Polygon));
+// Allocates from the arena if there is one, with malloc otherwise
+void* polygon_alloc(Arena* parena, size_t size){
+    if (parena != NULL)
+        return arena_alloc(parena, size);
+    return malloc(size);
+}
+
+// Polygons made in an arena go away with it, free_polygon is for the others
+Polygon* new_polygon(Point2D* vertices, int size, Arena* parena){
+    Polygon* pres = (Polygon*) polygon_alloc(parena, sizeof(Polygon));
+    check_allocation(pres, "Couldn\'t allocate memory for the polygon\n");
     pres->size = size;
 
-    PolygonVertex* phead = (PolygonVertex*) malloc(sizeof(PolygonVertex));
+    PolygonVertex* phead = (PolygonVertex*) polygon_alloc(parena, sizeof(PolygonVertex));
     check_allocation(phead, "Couldn\'t allocate memory for the polygon\n");
 
     phead->prev = phead;
@@ -118,7 +112,7 @@ Polygon* new_polygon(Point2D* vertices, int size){
     PolygonVertex* ptail = phead;
 
     for (int i = 1; i < size; i++){
-        PolygonVertex* pcurr = (PolygonVertex*) malloc(sizeof(PolygonVertex));
+        PolygonVertex* pcurr = (PolygonVertex*) polygon_alloc(parena, sizeof(PolygonVertex));
         check_allocation(pcurr, "Couldn\'t allocate memory for the new vertex\n");
         pcurr->index = i;
         pcurr->coordinates = vertices[i];
@@ -148,9 +142,15 @@ void free_polygon(Polygon* ppoly){
 }
 
 TriangleMesh* triangulate(Polygon* ppoly){
-    TriangleMesh* pres = (TriangleMesh*) malloc(sizeof(TriangleMesh) + (ppoly->size - 2) * sizeof(Triangle));
-    check_allocation(pres, "Couldn't allocate memory for mesh\n");
-    pres->size = 0;
+    TriangleMesh* pres = new_triangle_mesh(ppoly->size, ppoly->size - 2);
+
+    // The mesh's vertices are the polygon's, in the same order
+    PolygonVertex* pvertex = ppoly->head;
+    do {
+        Point3D pt = {pvertex->coordinates.x, pvertex->coordinates.y, 0};
+        add_vertex(pres, pt);
+        pvertex = pvertex->next;
+    } while (pvertex != ppoly->head);
  
     // First, find the top and bottom-most vertices
 
@@ -277,7 +277,7 @@ TriangleMesh* triangulate(Polygon* ppoly){
 
     struct MergedChain curr_vertex, prev_vertex;
 
-    Triangle make_triangle(PolygonVertex* p1, PolygonVertex* p2, PolygonVertex* p3, int poly_size){
+    void make_triangle(PolygonVertex* p1, PolygonVertex* p2, PolygonVertex* p3, int poly_size){
         // Fix triangle order
         PolygonVertex* tmp;
         if (p1->next == p2){
@@ -296,31 +296,19 @@ TriangleMesh* triangulate(Polygon* ppoly){
 
 
         // Check visibility
-        bool visible[3] = {false, false, false};
-        // bool visible[3] = {true, true, true};
+        uint8_t visible = 0;
         if (p1->prev == p2){
-            visible[0] = true;
+            visible |= EDGE_AB;
         }
         if (p2->prev == p3){
-            visible[1] = true;
+            visible |= EDGE_BC;
         }
         if (p3->prev == p1){
-            visible[2] = true;
+            visible |= EDGE_CA;
         }
 
         // Make triangle
-        Triangle res;
-        res.a.x = p1->coordinates.x;
-        res.a.y = p1->coordinates.y;
-        res.a.z = 0;
-        res.b.x = p2->coordinates.x;
-        res.b.y = p2->coordinates.y;
-        res.b.z = 0;
-        res.c.x = p3->coordinates.x;
-        res.c.y = p3->coordinates.y;
-        res.c.z = 0;
-        memcpy(res.visible, visible, 3*sizeof(bool));
-        return res;
+        add_triangle(pres, p1->index, p2->index, p3->index, visible);
     }
 
     // Next, go through all the remaining nodes from the merged chain
@@ -335,11 +323,10 @@ TriangleMesh* triangulate(Polygon* ppoly){
                     // Last item, don't join
                     break;
                 } else {
-                    pres = add_triangle(pres, make_triangle(
-                           chain[i].vertex,
-                           curr_vertex.vertex,
-                           peek().vertex,
-                           ppoly->size));
+                    make_triangle(chain[i].vertex,
+                                  curr_vertex.vertex,
+                                  peek().vertex,
+                                  ppoly->size);
                 }
             }
             // Push the last two vertices
@@ -361,18 +348,16 @@ TriangleMesh* triangulate(Polygon* ppoly){
                 Point3D cross = cross_product(v1, v2);
                 if (curr_vertex.chain == 1 && cross.z < 0){
                     // Left chain, can join
-                    pres = add_triangle(pres, make_triangle(
-                           chain[i].vertex,
-                           curr_vertex.vertex,
-                           prev_vertex.vertex,
-                           ppoly->size));
+                    make_triangle(chain[i].vertex,
+                                  curr_vertex.vertex,
+                                  prev_vertex.vertex,
+                                  ppoly->size);
                 } else if (curr_vertex.chain == 2 && cross.z > 0){
                     // Right chain, can join
-                    pres = add_triangle(pres, make_triangle(
-                           chain[i].vertex,
-                           curr_vertex.vertex,
-                           prev_vertex.vertex,
-                           ppoly->size));
+                    make_triangle(chain[i].vertex,
+                                  curr_vertex.vertex,
+                                  prev_vertex.vertex,
+                                  ppoly->size);
                 } else {
                     // Can't join
                     // Put it back
@@ -396,11 +381,10 @@ TriangleMesh* triangulate(Polygon* ppoly){
                     break;
                 else {
                     curr_vertex = pop();
-                    pres = add_triangle(pres, make_triangle(
-                           chain[i].vertex,
-                           curr_vertex.vertex,
-                           prev_vertex.vertex,
-                           ppoly->size));
+                    make_triangle(chain[i].vertex,
+                                  curr_vertex.vertex,
+                                  prev_vertex.vertex,
+                                  ppoly->size);
                 }
 
             }
@@ -409,18 +393,18 @@ TriangleMesh* triangulate(Polygon* ppoly){
     return pres;
 }
 
-Polygon* new_regular_polygon(float radius, int n_sides){
+Polygon* new_regular_polygon(float radius, int n_sides, Arena* parena){
     Point2D vertices[n_sides];
     for (int i = 0; i < n_sides; i++){
         vertices[i].x = radius * cosf(-i*2*M_PI / n_sides);
         vertices[i].y = radius * sinf(-i*2*M_PI / n_sides);
     }
-    Polygon* ppoly = new_polygon(vertices, n_sides);
+    Polygon* ppoly = new_polygon(vertices, n_sides, parena);
     return ppoly;
 }
 
 TriangleMesh* triangulated_regular_polygon(float radius, int n_sides){
-    Polygon* ppoly = new_regular_polygon(radius, n_sides);
+    Polygon* ppoly = new_regular_polygon(radius, n_sides, NULL);
     TriangleMesh* pres = triangulate(ppoly);
     free_polygon(ppoly);
     return pres;
@@ -433,7 +417,7 @@ TriangleMesh* prism(Polygon* pbase, float height){
 
 ProjectedMesh* new_projected_mesh(int size){
     ProjectedMesh* pres = (ProjectedMesh*) malloc(sizeof(ProjectedMesh) +
-                                                  size * sizeof(ProjectedEdge) * 3);
+                                                  size * sizeof(ProjectedEdge));
     check_allocation(pres, "Couldn\'t allocate memory for the projected mesh\n");
     pres->size = 0;
     return pres;
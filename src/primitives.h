@@ -2,6 +2,8 @@
 #define PRIMITIVES_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include "arena.h"
 
 // STRUCTS
 // 2D
@@ -35,6 +37,10 @@ typedef struct {
     Point3D a, b;
 } Edge3D;
 
+typedef struct {
+    Point3D min, max;
+} BoundingBox;
+
 // For hidden lines
 typedef struct {
     Edge2D edge2D;
@@ -43,16 +49,66 @@ typedef struct {
 
 
 // TRIANGULATED MESH
+// Edge visibility flags
+#define EDGE_AB 0x1
+#define EDGE_BC 0x2
+#define EDGE_CA 0x4
+#define EDGE_ALL (EDGE_AB | EDGE_BC | EDGE_CA)
+
+// A single face with its vertices looked up
 typedef struct {
     Point3D a, b, c;
-    bool visible[3]; // Tell if AB/BC/CD is visible or not
 } Triangle;
 
+// Vertex positions, one array per coordinate so that they can be
+// transformed several at a time
 typedef struct {
+    float* x;
+    float* y;
+    float* z;
+} VertexArray;
+
+// Indexed mesh: each vertex is stored once and shared between triangles.
+// Triangle i uses vertices indices[3*i], indices[3*i+1] and indices[3*i+2],
+// and visible[i] holds the EDGE_* flags telling if AB/BC/CA is visible.
+// The arrays are allocated for vertex_capacity vertices and capacity triangles
+typedef struct {
+    int n_vertices;
     int size;
-    Triangle triangles[];
+    int vertex_capacity;
+    int capacity;
+    VertexArray vertices;
+    int* indices;
+    uint8_t* visible;
 } TriangleMesh;
 
+// CULLED MESH
+// A mesh as seen from the camera: all of its vertices in camera space (with
+// the same indices as in the mesh) and on screen, and the indices of the
+// triangles that survived culling, sorted front to back. The buffers are
+// reused from frame to frame
+typedef struct {
+    TriangleMesh* pmesh;
+    VertexArray vertices;
+    Point2D* projected;
+    bool* inside;           // In front of the camera and within the frame
+    int size;
+    int* triangles;
+    bool* kept;             // For each triangle of the mesh
+    int* previous;          // The sorted triangles of the last frame
+    int previous_size;
+    int vertex_capacity, capacity;
+} CulledMesh;
+
+// FACE PLANES
+// The plane of each triangle, in the mesh's space. A point p is on the
+// plane when nx*p.x + ny*p.y + nz*p.z = d, and the triangle is seen from
+// the side where it is less than d. Computed once per mesh, for back-face culling
+typedef struct {
+    int size;
+    float *nx, *ny, *nz, *d;
+} FacePlanes;
+
 // PROJECTED EDGES
 typedef struct {
     int size;
@@ -61,10 +117,13 @@ typedef struct {
 
 
 // FUNCTIONS
-TriangleMesh* new_triangle_mesh(int size);
+TriangleMesh* new_triangle_mesh(int n_vertices, int size);
+void free_triangle_mesh(TriangleMesh* pmesh);
+Point3D get_vertex(VertexArray vertices, int i);
+Triangle get_triangle(TriangleMesh* pmesh, int i);
 TriangleMesh* prism(Polygon* pbase, float height);
-Polygon* new_polygon(Point2D* vertices, int size);
-Polygon* new_regular_polygon(float radius, int n_sides);
+Polygon* new_polygon(Point2D* vertices, int size, Arena* parena);
+Polygon* new_regular_polygon(float radius, int n_sides, Arena* parena);
 void free_polygon(Polygon* ppoly);
 TriangleMesh* triangulate(Polygon* ppoly);
 TriangleMesh* triangulated_regular_polygon(float radius, int n_sides);
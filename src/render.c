@@ -1,4 +1,16 @@
 #define EPSILON 0.0005 // Arbitrary value to avoid lines intersecting with their own faces
+#define DEPTH_SLOPE_BIAS 1.5 // Faces are pushed back by this many pixels of their depth slope...
+#define DEPTH_BIAS 0.001 // ...and this fraction of their depth, so they don't hide their own edges
+#define OCCLUSION_BIAS 0.0001 // Fraction of 1/z a face needs to be in front of an edge to hide it
+#define SEGMENT_EPSILON 0.00001 // Hidden intervals closer than this along an edge are joined
+#define EDGE_CHUNK 32 // Edges handed to a worker at once during HLR
+#define TILE_SIZE 64 // Side of the square tiles the frame is split into, in pixels
+#define TILES_X ((WIDTH + TILE_SIZE - 1) / TILE_SIZE)
+#define TILES_Y ((HEIGHT + TILE_SIZE - 1) / TILE_SIZE)
+#define CELL_SIZE 32 // Side of the cells occluders are sorted into during HLR, in pixels
+#define CELLS_X ((WIDTH + CELL_SIZE - 1) / CELL_SIZE)
+#define CELLS_Y ((HEIGHT + CELL_SIZE - 1) / CELL_SIZE)
+#define CELL_EPSILON 0.001 // Margin around the cells, so edges on their border aren't missed
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,44 +22,162 @@
 #include "primitives.h"
 #include "transforms.h"
 #include "vect.h"
+#include "edges.h"
+#include "bvh.h"
 #include "render.h"
 #include "utils.h"
+#include "workers.h"
+#include "arena.h"
 
 
+// What hidden-line removal needs for one frame
 typedef struct {
-    Point3D min, max;
-} BoundingBox;
+    HLRMode mode;
+    BVH* pbvh;
+    Point3D eye;            // Camera position, in world space
+    float inverse_mat[16];  // From camera space back to world space
+    float* pdepth;          // 1/z of the closest face for each pixel, 0 if none
+} HLRContext;
+
+// A face that survived culling, clipped by the focal plane and projected
+typedef struct {
+    Point2D pts[3];
+    BoundingBox bbox;        // On screen, z is unused
+    float inv_z, slope_x, slope_y; // 1/z = inv_z + slope_x * x + slope_y * y on screen
+    float min_z;             // Closest vertex of the original face
+} Occluder;
+
+// Occluders overlapping each cell of the frame are pcells[pstarts[i]] to
+// pcells[pstarts[i + 1]], still sorted by depth. What's outside the frame
+// goes in the cells on its border
+typedef struct {
+    int size;
+    int pstarts[CELLS_X * CELLS_Y + 1];
+    int* pcells;
+    Occluder occluders[];
+} OccluderList;
+
+// Part of an edge, as ratios of its length on screen
+typedef struct {
+    float start, end;
+} Interval;
+
+// Edges shared between the workers looking for visible segments
+typedef struct {
+    ProjectedMesh* pproj;
+    OccluderList* poccluders;
+    ProjectedMesh** pparts;   // Segments found by each worker
+    int* pcapacities;
+    Interval* pvisible;       // Scratch intervals, one run of n_intervals per worker
+    int n_intervals;
+    int* pseen;               // Last edge each occluder was tested against, one run per worker
+    Camera* pcam;
+    int next_edge;
+} SegmentJob;
+
+// A line in pixel coordinates. Step k along the major axis moves the
+// minor axis by floor((2 * k * minor + n) / (2 * n)) pixels
+typedef struct {
+    int start_major, start_minor;
+    int step_major, step_minor; // 1 or -1
+    int n;                      // Length along the major axis
+    int minor;                  // Length along the minor axis, at most n
+    bool x_major;
+} PixelLine;
+
+// Part of the frame, from x0, y0 included to x1, y1 excluded
+typedef struct {
+    int x0, y0, x1, y1;
+} Tile;
+
+// Lines crossing each tile, tile i having plines[pstarts[i]] to plines[pstarts[i + 1]]
+typedef struct {
+    PixelLine* ppixel_lines;
+    int pstarts[TILES_X * TILES_Y + 1];
+    int* plines;
+} TileBins;
+
+// What the workers need to draw the tiles
+typedef struct {
+    ProjectedMesh* plines;
+    TileBins* pbins;
+    HLRContext* phlr;
+    uint32_t* ppixels;
+    int next_tile;
+} TileJob;
+
+static float depth_buffer[WIDTH * HEIGHT];
+// Segments found by each worker, grown as needed and kept between frames
+static ProjectedMesh** psegment_parts = NULL;
+static int* psegment_capacities = NULL;
 
 
 // Projection
-ProjectedMesh* project_tri_mesh(TriangleMesh* ptri_mesh, Camera* pcam);
+ProjectedMesh* project_tri_mesh(CulledMesh* pculled, EdgeTable* pedges, Camera* pcam,
+                                Arena* parena);
 ProjectedEdge project_edge(Edge3D edge, Camera* pcam);
 // Clipping
 void clip_frustum(Edge3D* pedge, Camera* pcam);
 void clip_line(Edge3D* pedge, float ratio, bool reverse);
 // HLR
-bool ray_tri_intersect(Point3D* inter, Point3D point, Triangle tri);
-bool point_is_visible(Edge3D edge, float ratio, TriangleMesh* ptri_mesh, int start_idx);
+bool point_is_visible(Edge3D edge, float ratio, HLRContext* phlr);
+bool point_passes_depth_test(float inv_z, int x, int y, HLRContext* phlr);
+// Analytic HLR
+OccluderList* project_occluders(CulledMesh* pculled, Camera* pcam, Arena* parena);
+void bin_occluders(OccluderList* poccluders, Camera* pcam, Arena* parena);
+int cell_column(float x, Camera* pcam);
+int cell_row(float y, Camera* pcam);
+bool edge_crosses_cell(Point2D a, Point2D b, int column, int row, Camera* pcam);
+bool hidden_part(ProjectedEdge edge, Occluder* pocc, Interval* phidden);
+int visible_intervals(ProjectedEdge edge, OccluderList* poccluders, Camera* pcam,
+                      int* pseen, int stamp, Interval* pvisible);
+bool clip_interval(float value, float slope, Interval* pinterval);
+// Depth buffer
+void rasterize_depth(CulledMesh* pculled, Camera* pcam, float* pdepth);
+void rasterize_triangle_depth(Point3D* ppoints, Camera* pcam, float* pdepth);
 float obj_ratio_from_screen_ratio(Edge3D edge3D, Edge2D edge2D, float focal_length,
                                   float ratio, bool reverse);
+// Tiles
+ProjectedMesh* find_visible_segments(ProjectedMesh* pproj, CulledMesh* pculled, Camera* pcam,
+                                     Arena* parena);
+void segment_worker(void* pdata, int worker);
+PixelLine pixel_line(Edge2D edge, Camera* pcam);
+Tile get_tile(int i);
+bool line_range_in_tile(PixelLine* pline, Tile tile, int* pstart, int* pend);
+TileBins* bin_lines(ProjectedMesh* plines, Camera* pcam, Arena* parena);
+void tile_worker(void* pdata, int worker);
 // Pixel painting
-void draw_line(uint32_t* ppixels, ProjectedEdge edge, TriangleMesh* pmesh,
-               bool draw_hidden, Camera* pcam);
-// Bounding box
-BoundingBox bbox_from_edge(Edge3D edge);
-BoundingBox bbox_from_triangle(Triangle triangle);
+void draw_line(uint32_t* ppixels, ProjectedEdge edge, PixelLine* pline, Tile tile,
+               HLRContext* phlr);
 
-
-// Renders a mesh onto a pixel array, with or without HLR
-void render_mesh(TriangleMesh* pmesh, uint32_t* ppixels, Camera* pcam, bool do_hlr){
-    for (int i = 0; i < HEIGHT * WIDTH; i++){
-        ppixels[i] = BG_COLOR;
+// Renders a mesh onto a pixel array, with or without HLR.
+// Everything needed only for this frame comes from the frame arena
+void render_mesh(CulledMesh* pculled, EdgeTable* pedges, BVH* pbvh,
+                 uint32_t* ppixels, Camera* pcam, HLRMode hlr_mode, Arena* parena){
+    HLRContext hlr;
+    hlr.mode = hlr_mode;
+    hlr.pbvh = pbvh;
+    hlr.pdepth = depth_buffer;
+    if (hlr_mode == HLR_RAYCAST){
+        // The BVH is in world space, rays are brought back there
+        invert_affine_matrix(pcam->transform_mat, hlr.inverse_mat);
+        hlr.eye.x = hlr.inverse_mat[3];
+        hlr.eye.y = hlr.inverse_mat[7];
+        hlr.eye.z = hlr.inverse_mat[11];
+    } else if (hlr_mode == HLR_DEPTH_BUFFER){
+        rasterize_depth(pculled, pcam, hlr.pdepth);
     }
-    ProjectedMesh* pproj = project_tri_mesh(pmesh, pcam);
-    for (int i = 0; i < pproj->size; i++){
-        draw_line(ppixels, pproj->edges[i], pmesh, !do_hlr, pcam);
+
+    ProjectedMesh* plines = project_tri_mesh(pculled, pedges, pcam, parena);
+    if (hlr_mode == HLR_ANALYTIC){
+        // Only the visible parts of the edges are drawn
+        plines = find_visible_segments(plines, pculled, pcam, parena);
     }
-    free(pproj);
+
+    // Every tile is cleared and drawn by a single worker, they never
+    // write to the same pixels
+    TileJob job = {plines, bin_lines(plines, pcam, parena), &hlr, ppixels, 0};
+    run_on_workers(tile_worker, &job);
 }
 
 
@@ -64,39 +194,48 @@ ProjectedEdge project_edge(Edge3D edge, Camera* pcam){
 }
 
 
-ProjectedMesh* project_tri_mesh(TriangleMesh* ptri_mesh, Camera* pcam){
-    ProjectedMesh* pbuffer = new_projected_mesh(ptri_mesh->size);
-    Edge3D edges[3];
+// Vertices were already projected during culling
+ProjectedMesh* project_tri_mesh(CulledMesh* pculled, EdgeTable* pedges, Camera* pcam,
+                                Arena* parena){
+    ProjectedMesh* pbuffer = (ProjectedMesh*) arena_alloc(parena, sizeof(ProjectedMesh) +
+                                                          pedges->size * sizeof(ProjectedEdge));
+    bool* pkept = pculled->kept;
+    Point2D* pprojected = pculled->projected;
+    bool* pinside = pculled->inside;
+    Edge3D edge;
     ProjectedEdge curr_proj_edge;
 
+    // Each edge is projected only once, even when shared by two triangles
     int n = 0;
-    for (int i = 0; i < ptri_mesh->size; i++){
-        // Convert each triangle into three edges
-        // AB
-        edges[0].a = ptri_mesh->triangles[i].a;
-        edges[0].b = ptri_mesh->triangles[i].b;
-        // BC
-        edges[1].a = ptri_mesh->triangles[i].b;
-        edges[1].b = ptri_mesh->triangles[i].c;
-        // CA
-        edges[2].a = ptri_mesh->triangles[i].c;
-        edges[2].b = ptri_mesh->triangles[i].a;
+    MeshEdge* pmesh_edge;
+    for (int i = 0; i < pedges->size; i++){
+        pmesh_edge = &pedges->edges[i];
+        // Add only the visible edges, with at least one triangle left
+        if (!pmesh_edge->visible)
+            continue;
+        if (!edge_has_face(pedges, pmesh_edge, pkept))
+            continue;
 
-        for (int j = 0; j < 3; j++){
-            // Add only the visible edges
-            if (ptri_mesh->triangles[i].visible[j]) {
-                // Clip the line if it goes outside the frustum
-                clip_frustum(&edges[j], pcam);
-                // If there is nothing left
-                if (pt_is_null(edges[j].a) && pt_is_null(edges[j].b))
-                    continue;
-                // Project the edge
-                curr_proj_edge = project_edge(edges[j], pcam);
-                // Add it to the mesh
-                pbuffer->edges[n] = curr_proj_edge;
-                n += 1;
-            }
+        edge.a = get_vertex(pculled->vertices, pmesh_edge->a);
+        edge.b = get_vertex(pculled->vertices, pmesh_edge->b);
+
+        if (pinside[pmesh_edge->a] && pinside[pmesh_edge->b]){
+            // Reuse the projected vertices
+            curr_proj_edge.edge3D = edge;
+            curr_proj_edge.edge2D.a = pprojected[pmesh_edge->a];
+            curr_proj_edge.edge2D.b = pprojected[pmesh_edge->b];
+        } else {
+            // Clip the line if it goes outside the frustum
+            clip_frustum(&edge, pcam);
+            // If there is nothing left
+            if (pt_is_null(edge.a) && pt_is_null(edge.b))
+                continue;
+            // Project the edge
+            curr_proj_edge = project_edge(edge, pcam);
         }
+        // Add it to the mesh
+        pbuffer->edges[n] = curr_proj_edge;
+        n += 1;
     }
     pbuffer->size = n;
     return pbuffer;
@@ -217,57 +356,461 @@ void clip_frustum(Edge3D* pedge, Camera* pcam){
 
 
 // HLR
-bool ray_tri_intersect(Point3D* inter, Point3D point, Triangle tri){
-    Point3D ab = pt_diff(tri.b, tri.a),
-            bc = pt_diff(tri.c, tri.b),
-            ca = pt_diff(tri.a, tri.c),
-            normal = cross_product(ab, bc);
+bool point_is_visible(Edge3D edge, float ratio, HLRContext* phlr){
+    Point3D pt_obj = pt_add(pt_mul(ratio, edge.b),
+                            pt_mul((1-ratio), edge.a));
 
-    float q = dot_product(normal, tri.a) / dot_product(normal, point);
+    // Looking for a triangle between the camera and the point. The distance
+    // is linear along the ray, EPSILON in camera space becomes a ratio
+    Point3D pt_world = transform_point(phlr->inverse_mat, pt_obj);
+    return !segment_is_occluded(phlr->pbvh, phlr->eye, pt_world,
+                                1 - EPSILON / pt_obj.z);
+}
 
-    *inter = pt_mul(q, point);
 
-    // Is the ray intersecting with a triangle behind the camera ?
-    if (inter->z < 0)
-        return false;
+// Compares the point's depth with the closest face on its pixel
+bool point_passes_depth_test(float inv_z, int x, int y, HLRContext* phlr){
+    return inv_z >= phlr->pdepth[x + WIDTH * y];
+}
 
-    return (
-        (
-            cross_product(pt_diff(*inter, tri.a), ab).z > 0 &&
-            cross_product(pt_diff(*inter, tri.b), bc).z > 0 &&
-            cross_product(pt_diff(*inter, tri.c), ca).z > 0
-        ) || (
-            cross_product(pt_diff(*inter, tri.a), ab).z <= 0 &&
-            cross_product(pt_diff(*inter, tri.b), bc).z <= 0 &&
-            cross_product(pt_diff(*inter, tri.c), ca).z <= 0
-        )
-    );
+
+// Analytic HLR
+// Projects the faces that survived culling, keeping them sorted by depth
+OccluderList* project_occluders(CulledMesh* pculled, Camera* pcam, Arena* parena){
+    // Clipping by the focal plane can split a face in two
+    OccluderList* pres = (OccluderList*) arena_alloc(parena, sizeof(OccluderList) +
+                                                     2 * pculled->size * sizeof(Occluder));
+    pres->size = 0;
+
+    Triangle tri;
+    Point3D in[3], out[4];
+    Point3D* ppts;
+    int n_out;
+    bool in_front, next_in_front;
+    float ratio, area, inv_z[3];
+    Occluder* pocc;
+
+    for (int i = 0; i < pculled->size; i++){
+        tri = get_culled_triangle(pculled, i);
+        in[0] = tri.a;
+        in[1] = tri.b;
+        in[2] = tri.c;
+
+        // Clipping the triangle against the focal plane
+        n_out = 0;
+        for (int j = 0; j < 3; j++){
+            in_front = in[j].z >= pcam->focal_length;
+            next_in_front = in[(j + 1) % 3].z >= pcam->focal_length;
+            if (in_front)
+                out[n_out++] = in[j];
+            if (in_front != next_in_front){
+                ratio = (pcam->focal_length - in[j].z) / (in[(j + 1) % 3].z - in[j].z);
+                out[n_out++] = pt_add(in[j], pt_mul(ratio, pt_diff(in[(j + 1) % 3], in[j])));
+            }
+        }
+
+        for (int k = 0; k + 2 < n_out; k++){
+            // Triangles 0, 1, 2 and 0, 2, 3
+            Point3D fan[3] = {out[0], out[k + 1], out[k + 2]};
+            ppts = fan;
+            pocc = &pres->occluders[pres->size];
+            for (int j = 0; j < 3; j++){
+                pocc->pts[j] = project_point(ppts[j], pcam);
+                inv_z[j] = 1 / ppts[j].z;
+            }
+
+            area = (pocc->pts[1].x - pocc->pts[0].x) * (pocc->pts[2].y - pocc->pts[0].y) -
+                   (pocc->pts[2].x - pocc->pts[0].x) * (pocc->pts[1].y - pocc->pts[0].y);
+            // Seen edge-on, it can't hide anything
+            if (area == 0)
+                continue;
+
+            // Ordering the vertices counterclockwise
+            if (area < 0){
+                Point2D tmp_pt = pocc->pts[1];
+                pocc->pts[1] = pocc->pts[2];
+                pocc->pts[2] = tmp_pt;
+                float tmp_z = inv_z[1];
+                inv_z[1] = inv_z[2];
+                inv_z[2] = tmp_z;
+                area = -area;
+            }
+
+            // Plane equation of 1/z on screen
+            pocc->slope_x = ((inv_z[1] - inv_z[0]) * (pocc->pts[2].y - pocc->pts[0].y) -
+                             (inv_z[2] - inv_z[0]) * (pocc->pts[1].y - pocc->pts[0].y)) / area;
+            pocc->slope_y = ((inv_z[2] - inv_z[0]) * (pocc->pts[1].x - pocc->pts[0].x) -
+                             (inv_z[1] - inv_z[0]) * (pocc->pts[2].x - pocc->pts[0].x)) / area;
+            pocc->inv_z = inv_z[0] - pocc->slope_x * pocc->pts[0].x
+                                   - pocc->slope_y * pocc->pts[0].y;
+
+            pocc->bbox.min.x = fminf(fminf(pocc->pts[0].x, pocc->pts[1].x), pocc->pts[2].x);
+            pocc->bbox.min.y = fminf(fminf(pocc->pts[0].y, pocc->pts[1].y), pocc->pts[2].y);
+            pocc->bbox.max.x = fmaxf(fmaxf(pocc->pts[0].x, pocc->pts[1].x), pocc->pts[2].x);
+            pocc->bbox.max.y = fmaxf(fmaxf(pocc->pts[0].y, pocc->pts[1].y), pocc->pts[2].y);
+            pocc->min_z = fminf(fminf(tri.a.z, tri.b.z), tri.c.z);
+            pres->size += 1;
+        }
+    }
+    return pres;
 }
 
+// Sorts the occluders into the cells their bounding box overlaps. Counting
+// first, then filling, so each cell's occluders stay in depth order
+void bin_occluders(OccluderList* poccluders, Camera* pcam, Arena* parena){
+    memset(poccluders->pstarts, 0, sizeof(poccluders->pstarts));
+    Occluder* pocc;
+    int col0, col1, row0, row1;
+    for (int pass = 0; pass < 2; pass++){
+        for (int i = 0; i < poccluders->size; i++){
+            pocc = &poccluders->occluders[i];
+            col0 = cell_column(pocc->bbox.min.x, pcam);
+            col1 = cell_column(pocc->bbox.max.x, pcam);
+            row0 = cell_row(pocc->bbox.min.y, pcam);
+            row1 = cell_row(pocc->bbox.max.y, pcam);
+            for (int row = row0; row <= row1; row++){
+                for (int col = col0; col <= col1; col++){
+                    if (pass == 0)
+                        poccluders->pstarts[col + CELLS_X * row + 1] += 1;
+                    else
+                        poccluders->pcells[poccluders->pstarts[col + CELLS_X * row]++] = i;
+                }
+            }
+        }
 
-bool point_is_visible(Edge3D edge, float ratio, TriangleMesh* ptri_mesh, int start_idx){
-    Point3D pt_obj = pt_add(pt_mul(ratio, edge.b),
-                            pt_mul((1-ratio), edge.a));
+        if (pass == 0){
+            for (int i = 0; i < CELLS_X * CELLS_Y; i++)
+                poccluders->pstarts[i + 1] += poccluders->pstarts[i];
+            poccluders->pcells = (int*) arena_alloc(parena, (poccluders->pstarts[CELLS_X * CELLS_Y] + 1) * sizeof(int));
+        } else {
+            // Filling moved each start to the next cell's
+            for (int i = CELLS_X * CELLS_Y; i > 0; i--)
+                poccluders->pstarts[i] = poccluders->pstarts[i - 1];
+            poccluders->pstarts[0] = 0;
+        }
+    }
+}
+
+// Cell containing a point on screen, the ones on the border taking
+// everything beyond it
+int cell_column(float x, Camera* pcam){
+    float col = floorf((x + pcam->width/2) * SCALE / CELL_SIZE);
+    if (!(col >= 0))
+        return 0;
+    return col < CELLS_X - 1 ? (int) col : CELLS_X - 1;
+}
+
+int cell_row(float y, Camera* pcam){
+    float row = floorf((y + pcam->height/2) * SCALE / CELL_SIZE);
+    if (!(row >= 0))
+        return 0;
+    return row < CELLS_Y - 1 ? (int) row : CELLS_Y - 1;
+}
+
+// True if some part of the edge from a to b is in the cell, which is
+// clipped like a line against a rectangle
+bool edge_crosses_cell(Point2D a, Point2D b, int column, int row, Camera* pcam){
+    float x0 = column == 0 ? -INFINITY : (float) column * CELL_SIZE / SCALE - pcam->width/2 - CELL_EPSILON,
+          x1 = column == CELLS_X - 1 ? INFINITY : (float) (column + 1) * CELL_SIZE / SCALE - pcam->width/2 + CELL_EPSILON,
+          y0 = row == 0 ? -INFINITY : (float) row * CELL_SIZE / SCALE - pcam->height/2 - CELL_EPSILON,
+          y1 = row == CELLS_Y - 1 ? INFINITY : (float) (row + 1) * CELL_SIZE / SCALE - pcam->height/2 + CELL_EPSILON;
+    Interval inside = {0, 1};
+    return clip_interval(a.x - x0, b.x - a.x, &inside) &&
+           clip_interval(x1 - a.x, a.x - b.x, &inside) &&
+           clip_interval(a.y - y0, b.y - a.y, &inside) &&
+           clip_interval(y1 - a.y, a.y - b.y, &inside);
+}
+
+// Keeps the part of an interval where value + slope * ratio >= 0.
+// Returns false if nothing is left
+bool clip_interval(float value, float slope, Interval* pinterval){
+    if (slope == 0)
+        return value >= 0;
+
+    float ratio = -value / slope;
+    if (slope > 0)
+        pinterval->start = fmaxf(pinterval->start, ratio);
+    else
+        pinterval->end = fminf(pinterval->end, ratio);
+    return pinterval->start < pinterval->end;
+}
+
+int comp_interval(const void* pa, const void* pb){
+    float start_a = ((Interval*) pa)->start,
+          start_b = ((Interval*) pb)->start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+// Finds the part of an edge an occluder hides. Returns false if there is none
+bool hidden_part(ProjectedEdge edge, Occluder* pocc, Interval* phidden){
+    Point2D a = edge.edge2D.a,
+            b = edge.edge2D.b;
+    Point2D dir = {b.x - a.x, b.y - a.y};
+    // 1/z varies linearly along the edge on screen
+    float inv_z_a = 1 / edge.edge3D.a.z,
+          inv_z_b = 1 / edge.edge3D.b.z;
+    Point2D side;
+    float occ_z_a, occ_z_b;
+
+    // Part of the edge inside the triangle on screen
+    phidden->start = 0;
+    phidden->end = 1;
+    for (int j = 0; j < 3; j++){
+        side.x = pocc->pts[(j + 1) % 3].x - pocc->pts[j].x;
+        side.y = pocc->pts[(j + 1) % 3].y - pocc->pts[j].y;
+        if (!clip_interval(side.x * (a.y - pocc->pts[j].y) - side.y * (a.x - pocc->pts[j].x),
+                           side.x * dir.y - side.y * dir.x,
+                           phidden))
+            return false;
+    }
+
+    // Part of it where the triangle is in front of the edge
+    occ_z_a = pocc->inv_z + pocc->slope_x * a.x + pocc->slope_y * a.y;
+    occ_z_b = pocc->inv_z + pocc->slope_x * b.x + pocc->slope_y * b.y;
+    return clip_interval(occ_z_a - inv_z_a * (1 + OCCLUSION_BIAS),
+                         (occ_z_b - occ_z_a) - (inv_z_b - inv_z_a) * (1 + OCCLUSION_BIAS),
+                         phidden);
+}
+
+// Finds the parts of an edge that no face hides (quantitative invisibility
+// of 0), writes them in pvisible and returns how many there are.
+// pvisible must have room for one more interval than there are occluders.
+// Only the occluders in the cells the edge crosses are tested. An occluder
+// in several of them is tested once, pseen remembering the last stamp it got
+int visible_intervals(ProjectedEdge edge, OccluderList* poccluders, Camera* pcam,
+                      int* pseen, int stamp, Interval* pvisible){
+    Point2D a = edge.edge2D.a,
+            b = edge.edge2D.b;
+    float max_z = fmaxf(edge.edge3D.a.z, edge.edge3D.b.z);
 
-    Triangle curr_tri;
-    Point3D intersect;
     BoundingBox bbox;
+    bbox.min.x = fminf(a.x, b.x);
+    bbox.min.y = fminf(a.y, b.y);
+    bbox.max.x = fmaxf(a.x, b.x);
+    bbox.max.y = fmaxf(a.y, b.y);
+
+    // The hidden parts are gathered at the end of pvisible
+    int n_hidden = 0;
+    Interval* phidden = pvisible + 1;
+    Occluder* pocc;
+    int cell, occ;
+    int col0 = cell_column(bbox.min.x, pcam),
+        col1 = cell_column(bbox.max.x, pcam),
+        row0 = cell_row(bbox.min.y, pcam),
+        row1 = cell_row(bbox.max.y, pcam);
+
+    for (int row = row0; row <= row1; row++){
+        for (int col = col0; col <= col1; col++){
+            if (!edge_crosses_cell(a, b, col, row, pcam))
+                continue;
+            cell = col + CELLS_X * row;
+            for (int i = poccluders->pstarts[cell]; i < poccluders->pstarts[cell + 1]; i++){
+                occ = poccluders->pcells[i];
+                pocc = &poccluders->occluders[occ];
+                // Occluders are sorted by depth, the next ones are all behind the edge
+                if (pocc->min_z >= max_z)
+                    break;
+                if (pseen[occ] == stamp)
+                    continue;
+                pseen[occ] = stamp;
+                // Not overlapping on screen
+                if (pocc->bbox.max.x < bbox.min.x || pocc->bbox.min.x > bbox.max.x ||
+                    pocc->bbox.max.y < bbox.min.y || pocc->bbox.min.y > bbox.max.y)
+                    continue;
+                if (hidden_part(edge, pocc, &phidden[n_hidden]))
+                    n_hidden += 1;
+            }
+        }
+    }
+
+    // Whatever is not covered by a hidden interval is visible
+    qsort(phidden, n_hidden, sizeof(Interval), comp_interval);
+    int n_visible = 0;
+    float start = 0;
+    for (int i = 0; i < n_hidden; i++){
+        if (phidden[i].start > start + SEGMENT_EPSILON){
+            pvisible[n_visible].start = start;
+            pvisible[n_visible].end = phidden[i].start;
+            n_visible += 1;
+        }
+        start = fmaxf(start, phidden[i].end);
+    }
+    if (start < 1 - SEGMENT_EPSILON){
+        pvisible[n_visible].start = start;
+        pvisible[n_visible].end = 1;
+        n_visible += 1;
+    }
+    return n_visible;
+}
+
+
+// Replaces each edge with its visible parts. Edges are spread across the workers
+ProjectedMesh* find_visible_segments(ProjectedMesh* pproj, CulledMesh* pculled, Camera* pcam,
+                                     Arena* parena){
+    if (psegment_parts == NULL){
+        psegment_parts = (ProjectedMesh**) calloc(worker_count(), sizeof(ProjectedMesh*));
+        psegment_capacities = (int*) calloc(worker_count(), sizeof(int));
+        check_allocation(psegment_parts, "Couldn\'t allocate memory for the visible segments\n");
+        check_allocation(psegment_capacities, "Couldn\'t allocate memory for the visible segments\n");
+    }
+
+    // The workers can't share the arena, their scratch space is set aside here
+    OccluderList* poccluders = project_occluders(pculled, pcam, parena);
+    bin_occluders(poccluders, pcam, parena);
+    int n_intervals = poccluders->size + 1;
+    Interval* pvisible = (Interval*) arena_alloc(parena, worker_count() * n_intervals * sizeof(Interval));
+    int* pseen = (int*) arena_alloc(parena, worker_count() * poccluders->size * sizeof(int));
+    memset(pseen, 0, worker_count() * poccluders->size * sizeof(int));
+    SegmentJob job = {pproj, poccluders, psegment_parts, psegment_capacities,
+                      pvisible, n_intervals, pseen, pcam, 0};
+    run_on_workers(segment_worker, &job);
+
+    int size = 0;
+    for (int i = 0; i < worker_count(); i++)
+        size += psegment_parts[i]->size;
 
-    for (int i = start_idx; i<ptri_mesh->size; i++){
-        curr_tri = ptri_mesh->triangles[i];
-        bbox = bbox_from_triangle(curr_tri);
+    ProjectedMesh* pres = (ProjectedMesh*) arena_alloc(parena, sizeof(ProjectedMesh) +
+                                                       size * sizeof(ProjectedEdge));
+    pres->size = 0;
+    for (int i = 0; i < worker_count(); i++){
+        memcpy(pres->edges + pres->size, psegment_parts[i]->edges,
+               psegment_parts[i]->size * sizeof(ProjectedEdge));
+        pres->size += psegment_parts[i]->size;
+    }
+    return pres;
+}
 
-        // If point is totally in front of curr_tri, it doesn't intersect it
-        if (pt_obj.z < bbox.min.z)
-            return true;
+void segment_worker(void* pdata, int worker){
+    SegmentJob* pjob = (SegmentJob*) pdata;
+    Interval* pvisible = pjob->pvisible + worker * pjob->n_intervals;
+    int* pseen = pjob->pseen + worker * pjob->poccluders->size;
 
-        if (ray_tri_intersect(&intersect, pt_obj, curr_tri)){
-            if (intersect.z + EPSILON < pt_obj.z){
-                return false;
+    int capacity = pjob->pcapacities[worker];
+    ProjectedMesh* pres = pjob->pparts[worker];
+    if (pres == NULL){
+        capacity = 16;
+        pres = new_projected_mesh(capacity);
+    }
+    pres->size = 0;
+
+    int start, end, n;
+    ProjectedEdge edge, segment;
+    while (next_chunk(&pjob->next_edge, EDGE_CHUNK, pjob->pproj->size, &start, &end)){
+        for (int i = start; i < end; i++){
+            edge = pjob->pproj->edges[i];
+            // Each edge has its own stamp, so nothing needs clearing between them
+            n = visible_intervals(edge, pjob->poccluders, pjob->pcam, pseen, i + 1, pvisible);
+            if (pres->size + n > capacity){
+                while (pres->size + n > capacity)
+                    capacity *= 2;
+                pres = realloc(pres, sizeof(ProjectedMesh) + capacity * sizeof(ProjectedEdge));
+                check_allocation(pres, "Couldn\'t allocate memory for the visible segments\n");
+            }
+            for (int j = 0; j < n; j++){
+                segment.edge3D = edge.edge3D;
+                segment.edge2D.a.x = edge.edge2D.a.x + pvisible[j].start * (edge.edge2D.b.x - edge.edge2D.a.x);
+                segment.edge2D.a.y = edge.edge2D.a.y + pvisible[j].start * (edge.edge2D.b.y - edge.edge2D.a.y);
+                segment.edge2D.b.x = edge.edge2D.a.x + pvisible[j].end * (edge.edge2D.b.x - edge.edge2D.a.x);
+                segment.edge2D.b.y = edge.edge2D.a.y + pvisible[j].end * (edge.edge2D.b.y - edge.edge2D.a.y);
+                pres->edges[pres->size++] = segment;
             }
         }
     }
-    return true;
+    pjob->pparts[worker] = pres;
+    pjob->pcapacities[worker] = capacity;
+}
+
+// Depth buffer
+// Fills the depth buffer with the faces that survived culling
+void rasterize_depth(CulledMesh* pculled, Camera* pcam, float* pdepth){
+    // Nothing is in front of the background
+    memset(pdepth, 0, WIDTH * HEIGHT * sizeof(float));
+
+    Triangle tri;
+    Point3D in[3], out[4];
+    int n_out;
+    bool in_front, next_in_front;
+    float ratio;
+
+    for (int i = 0; i < pculled->size; i++){
+        tri = get_culled_triangle(pculled, i);
+        in[0] = tri.a;
+        in[1] = tri.b;
+        in[2] = tri.c;
+
+        // Clipping the triangle against the focal plane, this leaves a
+        // triangle or a quad
+        n_out = 0;
+        for (int j = 0; j < 3; j++){
+            in_front = in[j].z >= pcam->focal_length;
+            next_in_front = in[(j + 1) % 3].z >= pcam->focal_length;
+            if (in_front)
+                out[n_out++] = in[j];
+            if (in_front != next_in_front){
+                ratio = (pcam->focal_length - in[j].z) / (in[(j + 1) % 3].z - in[j].z);
+                out[n_out++] = pt_add(in[j], pt_mul(ratio, pt_diff(in[(j + 1) % 3], in[j])));
+            }
+        }
+
+        if (n_out >= 3)
+            rasterize_triangle_depth(out, pcam, pdepth);
+        if (n_out == 4){
+            // Other half of the quad: 0, 2, 3
+            out[1] = out[0];
+            rasterize_triangle_depth(&out[1], pcam, pdepth);
+        }
+    }
+}
+
+// Writes a triangle in front of the focal plane into the depth buffer
+void rasterize_triangle_depth(Point3D* ppoints, Camera* pcam, float* pdepth){
+    // 1/z varies linearly on screen
+    float x[3], y[3], inv_z[3];
+    Point2D proj;
+    for (int i = 0; i < 3; i++){
+        proj = project_point(ppoints[i], pcam);
+        x[i] = (proj.x + pcam->width/2)*SCALE;
+        y[i] = (proj.y + pcam->height/2)*SCALE;
+        inv_z[i] = 1 / ppoints[i].z;
+    }
+
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0)
+        return;
+
+    // Plane equation of 1/z on screen, pushed back according to its slope
+    float slope_x = ((inv_z[1] - inv_z[0]) * (y[2] - y[0]) -
+                     (inv_z[2] - inv_z[0]) * (y[1] - y[0])) / area,
+          slope_y = ((inv_z[2] - inv_z[0]) * (x[1] - x[0]) -
+                     (inv_z[1] - inv_z[0]) * (x[2] - x[0])) / area;
+    float offset = inv_z[0] - slope_x * x[0] - slope_y * y[0]
+                 - DEPTH_SLOPE_BIAS * fmaxf(fabsf(slope_x), fabsf(slope_y))
+                 - DEPTH_BIAS * fmaxf(fmaxf(inv_z[0], inv_z[1]), inv_z[2]);
+
+    // Bounding box on screen
+    int min_x = (int) fmaxf(floorf(fminf(fminf(x[0], x[1]), x[2])), 0),
+        max_x = (int) fminf(ceilf(fmaxf(fmaxf(x[0], x[1]), x[2])), WIDTH - 1),
+        min_y = (int) fmaxf(floorf(fminf(fminf(y[0], y[1]), y[2])), 0),
+        max_y = (int) fminf(ceilf(fmaxf(fmaxf(y[0], y[1]), y[2])), HEIGHT - 1);
+
+    // Edge functions have the same sign as the area inside the triangle
+    float sign = area > 0 ? 1 : -1;
+    float px, py, w0, w1, w2, depth;
+    for (int j = min_y; j <= max_y; j++){
+        py = j + 0.5;
+        for (int i = min_x; i <= max_x; i++){
+            px = i + 0.5;
+            w0 = sign * ((x[2] - x[1]) * (py - y[1]) - (y[2] - y[1]) * (px - x[1]));
+            w1 = sign * ((x[0] - x[2]) * (py - y[2]) - (y[0] - y[2]) * (px - x[2]));
+            w2 = sign * ((x[1] - x[0]) * (py - y[0]) - (y[1] - y[0]) * (px - x[0]));
+            if (w0 < 0 || w1 < 0 || w2 < 0)
+                continue;
+
+            depth = offset + slope_x * px + slope_y * py;
+            if (depth > pdepth[i + WIDTH * j])
+                pdepth[i + WIDTH * j] = depth;
+        }
+    }
 }
 
 
@@ -333,93 +876,260 @@ float obj_ratio_from_screen_ratio(Edge3D edge3D, Edge2D edge2D, float focal_leng
 }
 
 
-// Pixel painting
-void draw_line(uint32_t* ppixels, ProjectedEdge edge, TriangleMesh* pmesh,
-               bool draw_hidden, Camera* pcam){
-
-    Edge2D centered = edge.edge2D;
-    centered.a.x = (centered.a.x + pcam->width/2)*SCALE;
-    centered.a.y = (centered.a.y + pcam->height/2)*SCALE;
-    centered.b.x = (centered.b.x + pcam->width/2)*SCALE;
-    centered.b.y = (centered.b.y + pcam->height/2)*SCALE;
-
-    int x0 = (int) centered.a.x,
-        y0 = (int) centered.a.y,
-        x1 = (int) centered.b.x,
-        y1 = (int) centered.b.y;
-    int dx = abs(x1 - x0);
-    int sx = x0 < x1 ? 1 : -1;
-    int dy = -abs(y1 - y0);
-    int sy = y0 < y1 ? 1 : -1;
-    int err = dx+dy,
-        e2;
-
-    float screen_ratio, obj_ratio;
-    float span = sqrt(pow(dx, 2) + pow(dy, 2));
-    int x_init = x0;
-    int y_init = y0;
-
-    int i=0;
-
-    if (!draw_hidden){
-        // Check when the line's bounding box gets obstructed
-        Triangle curr_tri;
-
-        BoundingBox edge_bbox = bbox_from_edge(edge.edge3D),
-                    tri_bbox;
-
-        for (i=0; i < pmesh->size; i++){
-            curr_tri = pmesh->triangles[i];
-
-            tri_bbox = bbox_from_triangle(curr_tri);
-
-            // If the edge's bbox is completely in front of this triangle's bounding box,
-            // it is not hidden by this triangle, nor by any other
-            if (edge_bbox.max.z < tri_bbox.min.z){
-                i = pmesh->size - 1;
-                break;
+// Tiles
+// Converts an edge on screen to pixel coordinates
+PixelLine pixel_line(Edge2D edge, Camera* pcam){
+    int x0 = (int) ((edge.a.x + pcam->width/2)*SCALE),
+        y0 = (int) ((edge.a.y + pcam->height/2)*SCALE),
+        x1 = (int) ((edge.b.x + pcam->width/2)*SCALE),
+        y1 = (int) ((edge.b.y + pcam->height/2)*SCALE);
+    int dx = abs(x1 - x0),
+        dy = abs(y1 - y0);
+
+    PixelLine res;
+    res.x_major = dx >= dy;
+    if (res.x_major){
+        res.start_major = x0;
+        res.start_minor = y0;
+        res.step_major = x0 < x1 ? 1 : -1;
+        res.step_minor = y0 < y1 ? 1 : -1;
+        res.n = dx;
+        res.minor = dy;
+    } else {
+        res.start_major = y0;
+        res.start_minor = x0;
+        res.step_major = y0 < y1 ? 1 : -1;
+        res.step_minor = x0 < x1 ? 1 : -1;
+        res.n = dy;
+        res.minor = dx;
+    }
+    return res;
+}
+
+Tile get_tile(int i){
+    Tile res;
+    res.x0 = (i % TILES_X) * TILE_SIZE;
+    res.y0 = (i / TILES_X) * TILE_SIZE;
+    res.x1 = res.x0 + TILE_SIZE < WIDTH ? res.x0 + TILE_SIZE : WIDTH;
+    res.y1 = res.y0 + TILE_SIZE < HEIGHT ? res.y0 + TILE_SIZE : HEIGHT;
+    return res;
+}
+
+// Rounds towards negative infinity, unlike C's division
+long long floor_div(long long a, long long b){
+    long long res = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0)))
+        res -= 1;
+    return res;
+}
+
+// Finds the steps of a line that land in a tile. Returns false if there are none
+bool line_range_in_tile(PixelLine* pline, Tile tile, int* pstart, int* pend){
+    int lo_major, hi_major, lo_minor, hi_minor;
+    if (pline->x_major){
+        lo_major = tile.x0;
+        hi_major = tile.x1 - 1;
+        lo_minor = tile.y0;
+        hi_minor = tile.y1 - 1;
+    } else {
+        lo_major = tile.y0;
+        hi_major = tile.y1 - 1;
+        lo_minor = tile.x0;
+        hi_minor = tile.x1 - 1;
+    }
+
+    // Along the major axis, one pixel per step
+    long long start, end;
+    if (pline->step_major > 0){
+        start = (long long) lo_major - pline->start_major;
+        end = (long long) hi_major - pline->start_major;
+    } else {
+        start = (long long) pline->start_major - hi_major;
+        end = (long long) pline->start_major - lo_major;
+    }
+    if (start < 0)
+        start = 0;
+    if (end > pline->n)
+        end = pline->n;
+
+    // Along the minor axis, the offset never decreases
+    long long min_offset, max_offset;
+    if (pline->step_minor > 0){
+        min_offset = (long long) lo_minor - pline->start_minor;
+        max_offset = (long long) hi_minor - pline->start_minor;
+    } else {
+        min_offset = (long long) pline->start_minor - hi_minor;
+        max_offset = (long long) pline->start_minor - lo_minor;
+    }
+    if (pline->minor == 0){
+        if (min_offset > 0 || max_offset < 0)
+            return false;
+    } else {
+        long long n = pline->n,
+                  minor = pline->minor;
+        long long first = -floor_div(-(2 * n * min_offset - n), 2 * minor),
+                  last = floor_div(2 * n * max_offset + n - 1, 2 * minor);
+        if (first > start)
+            start = first;
+        if (last < end)
+            end = last;
+    }
+
+    if (start > end)
+        return false;
+    *pstart = (int) start;
+    *pend = (int) end;
+    return true;
+}
+
+// Lists the lines crossing each tile
+TileBins* bin_lines(ProjectedMesh* plines, Camera* pcam, Arena* parena){
+    TileBins* pres = (TileBins*) arena_alloc(parena, sizeof(TileBins));
+    pres->ppixel_lines = (PixelLine*) arena_alloc(parena, plines->size * sizeof(PixelLine));
+    memset(pres->pstarts, 0, sizeof(pres->pstarts));
+
+    // Counting first, then filling, so each tile's lines end up next to
+    // each other and in the same order on every frame
+    int start, end;
+    for (int pass = 0; pass < 2; pass++){
+        for (int i = 0; i < plines->size; i++){
+            PixelLine* pline = &pres->ppixel_lines[i];
+            if (pass == 0)
+                *pline = pixel_line(plines->edges[i].edge2D, pcam);
+
+            // Only looking at the tiles in the line's bounding box
+            int x_a = pline->x_major ? pline->start_major : pline->start_minor,
+                y_a = pline->x_major ? pline->start_minor : pline->start_major;
+            int x_b = x_a + (pline->x_major ? pline->step_major * pline->n
+                                            : pline->step_minor * pline->minor),
+                y_b = y_a + (pline->x_major ? pline->step_minor * pline->minor
+                                            : pline->step_major * pline->n);
+            int min_x = x_a < x_b ? x_a : x_b,
+                max_x = x_a < x_b ? x_b : x_a,
+                min_y = y_a < y_b ? y_a : y_b,
+                max_y = y_a < y_b ? y_b : y_a;
+            if (max_x < 0 || min_x >= WIDTH || max_y < 0 || min_y >= HEIGHT)
+                continue;
+            int tx0 = min_x < 0 ? 0 : min_x / TILE_SIZE,
+                tx1 = max_x >= WIDTH ? TILES_X - 1 : max_x / TILE_SIZE,
+                ty0 = min_y < 0 ? 0 : min_y / TILE_SIZE,
+                ty1 = max_y >= HEIGHT ? TILES_Y - 1 : max_y / TILE_SIZE;
+
+            for (int ty = ty0; ty <= ty1; ty++){
+                for (int tx = tx0; tx <= tx1; tx++){
+                    int tile = tx + TILES_X * ty;
+                    if (!line_range_in_tile(pline, get_tile(tile), &start, &end))
+                        continue;
+                    if (pass == 0)
+                        pres->pstarts[tile + 1] += 1;
+                    else
+                        pres->plines[pres->pstarts[tile]++] = i;
+                }
             }
-            break;
-        }
-    };
-
-    // Bresenham
-    for (;;){
-        screen_ratio = sqrt(pow(x0 - x_init, 2) + pow(y0 - y_init, 2)) / span;
-        // Convert to ratio in object space
-        obj_ratio = obj_ratio_from_screen_ratio(edge.edge3D, edge.edge2D,
-                                                pcam->focal_length, screen_ratio, false);
-        if (x0 >= 0 && x0 < WIDTH && y0 >= 0 && y0 < HEIGHT)
-            if (draw_hidden)
-                ppixels[x0 + WIDTH * y0] = LINE_COLOR_1;
-            else if (point_is_visible(edge.edge3D, obj_ratio, pmesh, i))
-                    ppixels[x0 + WIDTH * y0] = LINE_COLOR_2;
-
-        if (x0 == x1 && y0 == y1) break;
-        e2 = 2*err;
-        if (e2 >= dy) {
-            err += dy;
-            x0 += sx;
         }
-        if (e2 <= dx) {
-            err += dx;
-            y0 += sy;
+
+        if (pass == 0){
+            for (int i = 0; i < TILES_X * TILES_Y; i++)
+                pres->pstarts[i + 1] += pres->pstarts[i];
+            pres->plines = (int*) arena_alloc(parena, (pres->pstarts[TILES_X * TILES_Y] + 1) * sizeof(int));
+        } else {
+            // Filling moved each start to the next tile's
+            for (int i = TILES_X * TILES_Y; i > 0; i--)
+                pres->pstarts[i] = pres->pstarts[i - 1];
+            pres->pstarts[0] = 0;
         }
     }
+    return pres;
 }
 
+// Takes tiles until there are none left, clears them and draws their lines
+void tile_worker(void* pdata, int worker){
+    TileJob* pjob = (TileJob*) pdata;
+    int start, end;
+    while (next_chunk(&pjob->next_tile, 1, TILES_X * TILES_Y, &start, &end)){
+        Tile tile = get_tile(start);
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++)
+                pjob->ppixels[x + WIDTH * y] = BG_COLOR;
 
-// Bounding box
-BoundingBox bbox_from_triangle(Triangle triangle){
-    BoundingBox res;
-    res.min = pt_min(pt_min(triangle.a, triangle.b), triangle.c);
-    res.max = pt_max(pt_max(triangle.a, triangle.b), triangle.c);
-    return res;
+        for (int i = pjob->pbins->pstarts[start]; i < pjob->pbins->pstarts[start + 1]; i++){
+            int line = pjob->pbins->plines[i];
+            draw_line(pjob->ppixels, pjob->plines->edges[line],
+                      &pjob->pbins->ppixel_lines[line], tile, pjob->phlr);
+        }
+    }
 }
 
-BoundingBox bbox_from_edge(Edge3D edge){
-    BoundingBox res;
-    res.min = pt_min(edge.a, edge.b);
-    res.max = pt_max(edge.a, edge.b);
-    return res;
+
+// Pixel painting
+// Draws the part of a line inside a tile
+void draw_line(uint32_t* ppixels, ProjectedEdge edge, PixelLine* pline, Tile tile,
+               HLRContext* phlr){
+    int start, end;
+    if (!line_range_in_tile(pline, tile, &start, &end))
+        return;
+
+    // Position of the first step, then incremental
+    long long two_n = 2 * (long long) pline->n;
+    long long num = 2 * (long long) start * pline->minor + pline->n;
+    int offset = two_n > 0 ? (int) (num / two_n) : 0;
+    long long remainder = two_n > 0 ? num % two_n : 0;
+
+    uint32_t color = phlr->mode == HLR_NONE ? LINE_COLOR_1 : LINE_COLOR_2;
+    int x, y;
+
+    if (phlr->mode == HLR_NONE || phlr->mode == HLR_ANALYTIC){
+        // Nothing to test, only Bresenham
+        for (int k = start; k <= end; k++){
+            if (pline->x_major){
+                x = pline->start_major + pline->step_major * k;
+                y = pline->start_minor + pline->step_minor * offset;
+            } else {
+                x = pline->start_minor + pline->step_minor * offset;
+                y = pline->start_major + pline->step_major * k;
+            }
+            ppixels[x + WIDTH * y] = color;
+
+            remainder += 2 * pline->minor;
+            if (remainder >= two_n){
+                remainder -= two_n;
+                offset += 1;
+            }
+        }
+        return;
+    }
+
+    // 1/z is linear on screen, and so is ratio/z. Both are stepped along
+    // the major axis, and their quotient is the ratio in object space
+    float inv_z_a = 1 / edge.edge3D.a.z,
+          inv_z_b = 1 / edge.edge3D.b.z;
+    float step = pline->n > 0 ? 1.0 / pline->n : 0;
+    float inv_z_step = (inv_z_b - inv_z_a) * step,
+          weight_step = inv_z_b * step;
+    float inv_z = inv_z_a + start * inv_z_step,
+          weight = start * weight_step;
+
+    for (int k = start; k <= end; k++){
+        if (pline->x_major){
+            x = pline->start_major + pline->step_major * k;
+            y = pline->start_minor + pline->step_minor * offset;
+        } else {
+            x = pline->start_minor + pline->step_minor * offset;
+            y = pline->start_major + pline->step_major * k;
+        }
+
+        if (phlr->mode == HLR_DEPTH_BUFFER){
+            if (point_passes_depth_test(inv_z, x, y, phlr))
+                ppixels[x + WIDTH * y] = color;
+        } else if (point_is_visible(edge.edge3D, weight / inv_z, phlr))
+            ppixels[x + WIDTH * y] = color;
+
+        inv_z += inv_z_step;
+        weight += weight_step;
+        remainder += 2 * pline->minor;
+        if (remainder >= two_n){
+            remainder -= two_n;
+            offset += 1;
+        }
+    }
 }
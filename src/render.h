@@ -6,7 +6,18 @@
 #define BG_COLOR 0xFFFFFFFF
 
 #include <stdint.h>
+#include "edges.h"
+#include "bvh.h"
+#include "arena.h"
 
-void render_mesh(TriangleMesh* pmesh, uint32_t* ppixels, Camera* pcam, bool do_hlr);
+typedef enum {
+    HLR_NONE,         // Plain wireframe
+    HLR_RAYCAST,      // Exact, one ray per pixel through the BVH
+    HLR_ANALYTIC,     // Exact, visible parts of each edge computed on screen
+    HLR_DEPTH_BUFFER  // Approximate, fast enough for every frame
+} HLRMode;
+
+void render_mesh(CulledMesh* pculled, EdgeTable* pedges, BVH* pbvh,
+                 uint32_t* ppixels, Camera* pcam, HLRMode hlr_mode, Arena* parena);
 
 #endif
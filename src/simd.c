@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <pthread.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static TransformKernel transform_kernel = NULL;
+static CullKernel cull_kernel = NULL;
+static pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+
+
+// Scalar version, also used for what's left after the vectorized loops
+void transform_scalar(float* matrix, VertexArray src, VertexArray dest, int n){
+    float x, y, z;
+    for (int i = 0; i < n; i++){
+        x = src.x[i];
+        y = src.y[i];
+        z = src.z[i];
+        dest.x[i] = x * matrix[0] + y * matrix[1] + z * matrix[2] + matrix[3];
+        dest.y[i] = x * matrix[4] + y * matrix[5] + z * matrix[6] + matrix[7];
+        dest.z[i] = x * matrix[8] + y * matrix[9] + z * matrix[10] + matrix[11];
+    }
+}
+
+// A triangle is culled when its three vertices are outside the same side of
+// the frustum, or when it faces away from the camera. The sides are tested
+// in camera space, x * focal_length < -half_width * z being left of it
+int cull_scalar(CullParams* pparams, int start, int end, bool* pkept, int* ptriangles){
+    VertexArray v = pparams->vertices;
+    FacePlanes* pplanes = pparams->pplanes;
+    float f = pparams->focal_length,
+          hw = pparams->half_width, neg_hw = -pparams->half_width,
+          hh = pparams->half_height, neg_hh = -pparams->half_height;
+    int n = 0;
+    int* pidx;
+    float x[3], y[3], z[3], xf[3], yf[3];
+    bool out;
+
+    for (int i = start; i < end; i++){
+        pidx = &pparams->indices[3*i];
+        for (int k = 0; k < 3; k++){
+            x[k] = v.x[pidx[k]];
+            y[k] = v.y[pidx[k]];
+            z[k] = v.z[pidx[k]];
+            xf[k] = x[k] * f;
+            yf[k] = y[k] * f;
+        }
+        out = (z[0] < f && z[1] < f && z[2] < f) ||
+              (xf[0] < z[0] * neg_hw && xf[1] < z[1] * neg_hw && xf[2] < z[2] * neg_hw) ||
+              (xf[0] > z[0] * hw && xf[1] > z[1] * hw && xf[2] > z[2] * hw) ||
+              (yf[0] < z[0] * neg_hh && yf[1] < z[1] * neg_hh && yf[2] < z[2] * neg_hh) ||
+              (yf[0] > z[0] * hh && yf[1] > z[1] * hh && yf[2] > z[2] * hh);
+        if (pparams->bface_cull)
+            out = out || pplanes->nx[i] * pparams->eye.x + pplanes->ny[i] * pparams->eye.y +
+                         pplanes->nz[i] * pparams->eye.z > pplanes->d[i];
+
+        pkept[i] = !out;
+        if (!out)
+            ptriangles[n++] = i;
+    }
+    return n;
+}
+
+// Skips the first i vertices of an array
+VertexArray vertex_array_offset(VertexArray array, int i){
+    VertexArray res = {array.x + i, array.y + i, array.z + i};
+    return res;
+}
+
+#ifdef HAS_X86_KERNELS
+// Operations are done in the same order as in the scalar version, so that
+// all kernels give the exact same results
+
+__attribute__((target("sse2")))
+void transform_sse(float* matrix, VertexArray src, VertexArray dest, int n){
+    __m128 m[12];
+    for (int k = 0; k < 12; k++)
+        m[k] = _mm_set1_ps(matrix[k]);
+
+    __m128 x, y, z;
+    int i;
+    for (i = 0; i + 4 <= n; i += 4){
+        x = _mm_loadu_ps(&src.x[i]);
+        y = _mm_loadu_ps(&src.y[i]);
+        z = _mm_loadu_ps(&src.z[i]);
+        _mm_storeu_ps(&dest.x[i], _mm_add_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(x, m[0]), _mm_mul_ps(y, m[1])), _mm_mul_ps(z, m[2])), m[3]));
+        _mm_storeu_ps(&dest.y[i], _mm_add_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(x, m[4]), _mm_mul_ps(y, m[5])), _mm_mul_ps(z, m[6])), m[7]));
+        _mm_storeu_ps(&dest.z[i], _mm_add_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(x, m[8]), _mm_mul_ps(y, m[9])), _mm_mul_ps(z, m[10])), m[11]));
+    }
+    transform_scalar(matrix, vertex_array_offset(src, i), vertex_array_offset(dest, i), n - i);
+}
+
+__attribute__((target("avx2")))
+void transform_avx2(float* matrix, VertexArray src, VertexArray dest, int n){
+    __m256 m[12];
+    for (int k = 0; k < 12; k++)
+        m[k] = _mm256_set1_ps(matrix[k]);
+
+    __m256 x, y, z;
+    int i;
+    for (i = 0; i + 8 <= n; i += 8){
+        x = _mm256_loadu_ps(&src.x[i]);
+        y = _mm256_loadu_ps(&src.y[i]);
+        z = _mm256_loadu_ps(&src.z[i]);
+        _mm256_storeu_ps(&dest.x[i], _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(x, m[0]), _mm256_mul_ps(y, m[1])), _mm256_mul_ps(z, m[2])), m[3]));
+        _mm256_storeu_ps(&dest.y[i], _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(x, m[4]), _mm256_mul_ps(y, m[5])), _mm256_mul_ps(z, m[6])), m[7]));
+        _mm256_storeu_ps(&dest.z[i], _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(x, m[8]), _mm256_mul_ps(y, m[9])), _mm256_mul_ps(z, m[10])), m[11]));
+    }
+    transform_sse(matrix, vertex_array_offset(src, i), vertex_array_offset(dest, i), n - i);
+}
+
+// True where a < bound_a, b < bound_b and c < bound_c
+__attribute__((target("avx2")))
+static inline __m256 all_less(__m256 a, __m256 b, __m256 c,
+                              __m256 bound_a, __m256 bound_b, __m256 bound_c){
+    return _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(a, bound_a, _CMP_LT_OQ),
+                                       _mm256_cmp_ps(b, bound_b, _CMP_LT_OQ)),
+                         _mm256_cmp_ps(c, bound_c, _CMP_LT_OQ));
+}
+
+// Eight triangles at a time, their vertices are gathered from the indices
+__attribute__((target("avx2")))
+int cull_avx2(CullParams* pparams, int start, int end, bool* pkept, int* ptriangles){
+    VertexArray v = pparams->vertices;
+    FacePlanes* pplanes = pparams->pplanes;
+    __m256 f = _mm256_set1_ps(pparams->focal_length),
+           hw = _mm256_set1_ps(pparams->half_width),
+           neg_hw = _mm256_set1_ps(-pparams->half_width),
+           hh = _mm256_set1_ps(pparams->half_height),
+           neg_hh = _mm256_set1_ps(-pparams->half_height),
+           eye_x = _mm256_set1_ps(pparams->eye.x),
+           eye_y = _mm256_set1_ps(pparams->eye.y),
+           eye_z = _mm256_set1_ps(pparams->eye.z);
+    __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+
+    __m256i ia, ib, ic;
+    __m256 za, zb, zc, xfa, xfb, xfc, yfa, yfb, yfc, out, dist;
+    int* pidx;
+    int n = 0, mask, i;
+    for (i = start; i + 8 <= end; i += 8){
+        pidx = &pparams->indices[3*i];
+        ia = _mm256_i32gather_epi32(pidx, stride, 4);
+        ib = _mm256_i32gather_epi32(pidx + 1, stride, 4);
+        ic = _mm256_i32gather_epi32(pidx + 2, stride, 4);
+        za = _mm256_i32gather_ps(v.z, ia, 4);
+        zb = _mm256_i32gather_ps(v.z, ib, 4);
+        zc = _mm256_i32gather_ps(v.z, ic, 4);
+        xfa = _mm256_mul_ps(_mm256_i32gather_ps(v.x, ia, 4), f);
+        xfb = _mm256_mul_ps(_mm256_i32gather_ps(v.x, ib, 4), f);
+        xfc = _mm256_mul_ps(_mm256_i32gather_ps(v.x, ic, 4), f);
+        yfa = _mm256_mul_ps(_mm256_i32gather_ps(v.y, ia, 4), f);
+        yfb = _mm256_mul_ps(_mm256_i32gather_ps(v.y, ib, 4), f);
+        yfc = _mm256_mul_ps(_mm256_i32gather_ps(v.y, ic, 4), f);
+
+        out = all_less(za, zb, zc, f, f, f);
+        out = _mm256_or_ps(out, all_less(xfa, xfb, xfc, _mm256_mul_ps(za, neg_hw),
+                                         _mm256_mul_ps(zb, neg_hw), _mm256_mul_ps(zc, neg_hw)));
+        out = _mm256_or_ps(out, all_less(_mm256_mul_ps(za, hw), _mm256_mul_ps(zb, hw),
+                                         _mm256_mul_ps(zc, hw), xfa, xfb, xfc));
+        out = _mm256_or_ps(out, all_less(yfa, yfb, yfc, _mm256_mul_ps(za, neg_hh),
+                                         _mm256_mul_ps(zb, neg_hh), _mm256_mul_ps(zc, neg_hh)));
+        out = _mm256_or_ps(out, all_less(_mm256_mul_ps(za, hh), _mm256_mul_ps(zb, hh),
+                                         _mm256_mul_ps(zc, hh), yfa, yfb, yfc));
+        if (pparams->bface_cull){
+            dist = _mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(_mm256_loadu_ps(&pplanes->nx[i]), eye_x),
+                _mm256_mul_ps(_mm256_loadu_ps(&pplanes->ny[i]), eye_y)),
+                _mm256_mul_ps(_mm256_loadu_ps(&pplanes->nz[i]), eye_z));
+            out = _mm256_or_ps(out, _mm256_cmp_ps(dist, _mm256_loadu_ps(&pplanes->d[i]), _CMP_GT_OQ));
+        }
+
+        // Compacting the indices of those left
+        mask = ~_mm256_movemask_ps(out) & 0xFF;
+        for (int k = 0; k < 8; k++)
+            pkept[i + k] = (mask >> k) & 1;
+        while (mask != 0){
+            ptriangles[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + cull_scalar(pparams, i, end, pkept, ptriangles + n);
+}
+#endif
+
+
+// Picks the widest kernels the CPU supports. Culling needs gathers, there
+// is no SSE version of it
+void pick_kernels(){
+#ifdef HAS_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        transform_kernel = transform_avx2;
+        cull_kernel = cull_avx2;
+        printf("Using AVX2 kernels\n");
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")){
+        transform_kernel = transform_sse;
+        cull_kernel = cull_scalar;
+        printf("Using SSE transform kernel\n");
+        return;
+    }
+#endif
+    transform_kernel = transform_scalar;
+    cull_kernel = cull_scalar;
+    printf("Using scalar kernels\n");
+}
+
+// The kernels are picked only once, even when the first calls come from
+// several threads at the same time
+void select_kernels(){
+    pthread_once(&kernels_selected, pick_kernels);
+}
+
+void transform_vertices(float* matrix, VertexArray src, VertexArray dest, int n){
+    select_kernels();
+    transform_kernel(matrix, src, dest, n);
+}
+
+int cull(CullParams* pparams, int start, int end, bool* pkept, int* ptriangles){
+    select_kernels();
+    return cull_kernel(pparams, start, end, pkept, ptriangles);
+}
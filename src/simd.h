@@ -0,0 +1,30 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdbool.h>
+#include "primitives.h"
+
+// Transforms n vertices from src with a 4x4 homogeneous matrix, and writes
+// them in dest. src and dest may be the same arrays
+typedef void (*TransformKernel)(float* matrix, VertexArray src, VertexArray dest, int n);
+
+// Everything the culling kernels need. The vertices are in camera space,
+// the eye is where the camera is in the mesh's space, like the planes
+typedef struct {
+    int* indices;
+    VertexArray vertices;
+    FacePlanes* pplanes;
+    Point3D eye;
+    float focal_length, half_width, half_height;
+    bool bface_cull;
+} CullParams;
+
+// Culls the triangles from start to end. Each one is marked in pkept, and
+// the indices of those left are written to ptriangles. Returns how many are left
+typedef int (*CullKernel)(CullParams* pparams, int start, int end, bool* pkept, int* ptriangles);
+
+void select_kernels();
+void transform_vertices(float* matrix, VertexArray src, VertexArray dest, int n);
+int cull(CullParams* pparams, int start, int end, bool* pkept, int* ptriangles);
+
+#endif
@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include "vect.h"
 #include "primitives.h"
 #include "transforms.h"
+#include "utils.h"
 
 // https://en.wikipedia.org/wiki/STL_(file_format)
 typedef struct __attribute__((__packed__)) {
@@ -20,9 +22,31 @@ typedef struct __attribute__((__packed__)) {
     STL_Triangle triangles[];
 } STL;
 
+// Vertices are welded through an open addressing hash table on their
+// coordinates, so that triangles sharing a corner share the vertex
+typedef struct {
+    int size;
+    int* slots;
+} VertexTable;
+
+uint32_t hash_vertex(Point3D pt){
+    uint32_t bits[3];
+    memcpy(bits, &pt, sizeof(bits));
+    return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+}
+
+int weld_vertex(TriangleMesh* pmesh, VertexTable* ptable, Point3D pt){
+    uint32_t slot = hash_vertex(pt) & (ptable->size - 1);
+    while (ptable->slots[slot] >= 0){
+        if (pt_equ(get_vertex(pmesh->vertices, ptable->slots[slot]), pt))
+            return ptable->slots[slot];
+        slot = (slot + 1) & (ptable->size - 1);
+    }
+    ptable->slots[slot] = add_vertex(pmesh, pt);
+    return ptable->slots[slot];
+}
+
 TriangleMesh* stl_to_tri_mesh(FILE* pfile){
-    TriangleMesh* pres = malloc(sizeof(TriangleMesh));
-    pres->size = 0;
     // Skip the first 80 bytes
     fseek(pfile, 80, SEEK_SET);
 
@@ -31,29 +55,35 @@ TriangleMesh* stl_to_tri_mesh(FILE* pfile){
     fread(&size, sizeof(int32_t), 1, pfile);
     printf("size: %d\n", size);
 
+    // Closed meshes have about half as many vertices as triangles
+    TriangleMesh* pres = new_triangle_mesh(size / 2 + 3, size);
+
+    // At most three new vertices per triangle, keep the table at most half full
+    VertexTable table = {1, NULL};
+    while (table.size < 6 * size)
+        table.size *= 2;
+    table.slots = (int*) malloc(table.size * sizeof(int));
+    check_allocation(table.slots, "Couldn't allocate memory to import the STL file\n");
+    memset(table.slots, -1, table.size * sizeof(int));
+
     // Read the triangle data
     STL_Triangle curr_stl_triangle;
-    Triangle curr_triangle;
+    Point3D v1, v2, v3;
 
     for (int i = 0; i < size; i++){
         fread(&curr_stl_triangle, sizeof(STL_Triangle), 1, pfile);
 
-        curr_triangle.b.x = curr_stl_triangle.vertex1[0];
-        curr_triangle.b.y = curr_stl_triangle.vertex1[1];
-        curr_triangle.b.z = curr_stl_triangle.vertex1[2];
-        curr_triangle.a.x = curr_stl_triangle.vertex3[0];
-        curr_triangle.a.y = curr_stl_triangle.vertex3[1];
-        curr_triangle.a.z = curr_stl_triangle.vertex3[2];
-        curr_triangle.c.x = curr_stl_triangle.vertex2[0];
-        curr_triangle.c.y = curr_stl_triangle.vertex2[1];
-        curr_triangle.c.z = curr_stl_triangle.vertex2[2];
-
-        curr_triangle.visible[0] = true;
-        curr_triangle.visible[1] = true;
-        curr_triangle.visible[2] = true;
-
-        pres = add_triangle(pres, curr_triangle);
+        memcpy(&v1, curr_stl_triangle.vertex1, sizeof(Point3D));
+        memcpy(&v2, curr_stl_triangle.vertex2, sizeof(Point3D));
+        memcpy(&v3, curr_stl_triangle.vertex3, sizeof(Point3D));
+
+        add_triangle(pres,
+                     weld_vertex(pres, &table, v3),
+                     weld_vertex(pres, &table, v1),
+                     weld_vertex(pres, &table, v2),
+                     EDGE_ALL);
     }
-    printf("STL imported: %d triangles\n", pres->size);
+    free(table.slots);
+    printf("STL imported: %d triangles, %d vertices\n", pres->size, pres->n_vertices);
     return pres;
 }
@@ -6,135 +6,228 @@
 #include "primitives.h"
 #include "camera.h"
 #include "vect.h"
+#include "simd.h"
+#include "arena.h"
+#include "workers.h"
+#include "transforms.h"
+
+#define CULL_CHUNK 256             // Vertices transformed and projected at once
+#define VERTEX_CHUNK (16*CULL_CHUNK) // Vertices handed to a worker at once
+#define TRIANGLE_CHUNK 4096         // Triangles culled by a worker at once
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (32 / RADIX_BITS)
+
+// Culling shared between the workers. Every chunk of triangles is culled on
+// its own, then what's left of it is moved after what's left of the chunks
+// before it, so the result doesn't depend on who did what
+typedef struct {
+    CulledMesh* pculled;
+    Camera* pcam;
+    CullParams params;
+    int* pleft;        // What's left of each chunk, from the chunk's first triangle
+    int* psizes;       // How much is left of each chunk
+    int* poffsets;     // Where it goes in the culled mesh
+    int n_chunks;
+    int next_vertex, next_chunk;
+} CullJob;
+
+uint32_t depth_key(float z);
+bool sort_like_before(CulledMesh* pculled, uint32_t* pkeys, Arena* parena);
+void radix_sort(int* pvalues, uint32_t* pkeys, int n, Arena* parena);
+void project_vertices(CulledMesh* pculled, Camera* pcam, int first, int last);
+void project_worker(void* pdata, int worker);
+void cull_worker(void* pdata, int worker);
+void compact_worker(void* pdata, int worker);
+
+
+// Mesh builder
+// Makes sure the mesh can hold at least n_vertices vertices and size
+// triangles without reallocating
+void reserve_mesh(TriangleMesh* pmesh, int n_vertices, int size){
+    if (n_vertices > pmesh->vertex_capacity){
+        float* px = realloc(pmesh->vertices.x, n_vertices * sizeof(float));
+        check_allocation(px, "Couldn't allocate memory for the mesh's vertices\n");
+        pmesh->vertices.x = px;
+        float* py = realloc(pmesh->vertices.y, n_vertices * sizeof(float));
+        check_allocation(py, "Couldn't allocate memory for the mesh's vertices\n");
+        pmesh->vertices.y = py;
+        float* pz = realloc(pmesh->vertices.z, n_vertices * sizeof(float));
+        check_allocation(pz, "Couldn't allocate memory for the mesh's vertices\n");
+        pmesh->vertices.z = pz;
+        pmesh->vertex_capacity = n_vertices;
+    }
+    if (size > pmesh->capacity){
+        int* pindices = realloc(pmesh->indices, 3 * size * sizeof(int));
+        check_allocation(pindices, "Couldn't allocate memory for the mesh's triangles\n");
+        uint8_t* pvisible = realloc(pmesh->visible, size * sizeof(uint8_t));
+        check_allocation(pvisible, "Couldn't allocate memory for the mesh's triangles\n");
+        pmesh->indices = pindices;
+        pmesh->visible = pvisible;
+        pmesh->capacity = size;
+    }
+}
 
-int comp_tri_z(const void* ptri_a, const void* ptri_b);
-bool facing_camera(Triangle tri);
+// Capacity to reserve when a mesh is full, doubling it keeps the cost of
+// appending constant on average
+int grown_capacity(int capacity, int needed){
+    int res = capacity < 16 ? 16 : capacity;
+    while (res < needed)
+        res *= 2;
+    return res;
+}
 
+int add_vertex(TriangleMesh* pmesh, Point3D vertex){
+    if (pmesh->n_vertices == pmesh->vertex_capacity)
+        reserve_mesh(pmesh, grown_capacity(pmesh->vertex_capacity, pmesh->n_vertices + 1), 0);
 
-TriangleMesh* add_triangle(TriangleMesh* pmesh, Triangle tri){
-    //Allocating more memory to add the new triangle
-    TriangleMesh* pres = realloc(pmesh, sizeof(TriangleMesh) + (pmesh->size + 1) * sizeof(Triangle));
-    check_allocation(pres, "Couldn't allocate memory to add a new triangle\n");
+    pmesh->vertices.x[pmesh->n_vertices] = vertex.x;
+    pmesh->vertices.y[pmesh->n_vertices] = vertex.y;
+    pmesh->vertices.z[pmesh->n_vertices] = vertex.z;
+    return pmesh->n_vertices++;
+}
 
-    pres->triangles[pres->size] = tri;
-    pres->size += 1;
-    return pres;
+void add_triangle(TriangleMesh* pmesh, int a, int b, int c, uint8_t visible){
+    if (pmesh->size == pmesh->capacity)
+        reserve_mesh(pmesh, 0, grown_capacity(pmesh->capacity, pmesh->size + 1));
+
+    pmesh->indices[3*pmesh->size] = a;
+    pmesh->indices[3*pmesh->size + 1] = b;
+    pmesh->indices[3*pmesh->size + 2] = c;
+    pmesh->visible[pmesh->size] = visible;
+    pmesh->size += 1;
 }
 
-TriangleMesh* merge_tri_meshes(TriangleMesh* pmesh1, TriangleMesh* pmesh2){
-    for (int i = 0; i < pmesh2->size; i++){
-        pmesh1 = add_triangle(pmesh1, pmesh2->triangles[i]);
+// Copies all of psrc's vertices and triangles at the end of pdest
+void append_mesh(TriangleMesh* pdest, TriangleMesh* psrc){
+    append_transformed_mesh(pdest, psrc, NULL);
+}
+
+// Same as append_mesh, but the appended vertices go through a matrix on the
+// way (if it isn't NULL). Vertices are only read and written once
+void append_transformed_mesh(TriangleMesh* pdest, TriangleMesh* psrc, float* matrix){
+    int n_vertices = pdest->n_vertices + psrc->n_vertices,
+        size = pdest->size + psrc->size;
+    if (n_vertices > pdest->vertex_capacity || size > pdest->capacity)
+        reserve_mesh(pdest,
+                     grown_capacity(pdest->vertex_capacity, n_vertices),
+                     grown_capacity(pdest->capacity, size));
+
+    copy_transformed_mesh(pdest, psrc, matrix, pdest->n_vertices, pdest->size);
+    pdest->n_vertices = n_vertices;
+    pdest->size = size;
+}
+
+// Writes psrc into pdest at the given offsets, which must already be
+// allocated. pdest's sizes are left untouched, so that separate parts
+// can be written at the same time
+void copy_transformed_mesh(TriangleMesh* pdest, TriangleMesh* psrc, float* matrix,
+                           int first_vertex, int first_triangle){
+    if (matrix == NULL){
+        memcpy(&pdest->vertices.x[first_vertex], psrc->vertices.x,
+               psrc->n_vertices * sizeof(float));
+        memcpy(&pdest->vertices.y[first_vertex], psrc->vertices.y,
+               psrc->n_vertices * sizeof(float));
+        memcpy(&pdest->vertices.z[first_vertex], psrc->vertices.z,
+               psrc->n_vertices * sizeof(float));
+    } else {
+        VertexArray dest = {&pdest->vertices.x[first_vertex],
+                            &pdest->vertices.y[first_vertex],
+                            &pdest->vertices.z[first_vertex]};
+        transform_vertices(matrix, psrc->vertices, dest, psrc->n_vertices);
+    }
+    memcpy(&pdest->indices[3*first_triangle], psrc->indices,
+           3 * psrc->size * sizeof(int));
+    memcpy(&pdest->visible[first_triangle], psrc->visible,
+           psrc->size * sizeof(uint8_t));
+
+    // The copied vertices go after the ones before them
+    int end = first_triangle + psrc->size;
+    if (first_vertex != 0){
+        for (int i = 3*first_triangle; i < 3*end; i++){
+            pdest->indices[i] += first_vertex;
+        }
     }
-    free(pmesh2);
+
+    if (matrix != NULL && is_mirroring(matrix)){
+        for (int i = first_triangle; i < end; i++)
+            flip_triangle(pdest, i);
+    }
+}
+
+TriangleMesh* merge_tri_meshes(TriangleMesh* pmesh1, TriangleMesh* pmesh2){
+    append_mesh(pmesh1, pmesh2);
+    free_triangle_mesh(pmesh2);
     return pmesh1;
 }
 
-void flip_triangle(Triangle* ptri){
-    Point3D tmp = ptri->a;
-    bool tmp_vis;
-    ptri->a = ptri->b;
-    ptri->b = tmp;
-    tmp_vis = ptri->visible[1];
-    ptri->visible[1] = ptri->visible[2];
-    ptri->visible[2] = tmp_vis;
+void flip_triangle(TriangleMesh* pmesh, int i){
+    // Swapping A and B turns BC into CA and CA into BC
+    int tmp = pmesh->indices[3*i];
+    uint8_t vis = pmesh->visible[i];
+    pmesh->indices[3*i] = pmesh->indices[3*i + 1];
+    pmesh->indices[3*i + 1] = tmp;
+    pmesh->visible[i] = (vis & EDGE_AB)
+                      | ((vis & EDGE_BC) ? EDGE_CA : 0)
+                      | ((vis & EDGE_CA) ? EDGE_BC : 0);
 }
 
 void flip_mesh(TriangleMesh* pmesh){
     for (int i = 0; i < pmesh->size; i++){
-        flip_triangle(&(pmesh->triangles[i]));
+        flip_triangle(pmesh, i);
     }
 }
 
 TriangleMesh* extrude(Polygon* ppoly, float height){
+    // Bottom
+    // Vertices 0 to n-1 are the base of the prism
+    TriangleMesh* pres = triangulate(ppoly);
+    int n = pres->n_vertices;
+    int n_cap = pres->size;
+    // Two caps, and two triangles per side
+    reserve_mesh(pres, 2 * n, 2 * n_cap + 2 * n);
+
     // Top
-    TriangleMesh* poly1 = triangulate(ppoly);
-    for (int i = 0; i < poly1->size; i++){
-        poly1->triangles[i].a.z += height;
-        poly1->triangles[i].b.z += height;
-        poly1->triangles[i].c.z += height;
+    // Vertices n to 2n-1 are the same, lifted by height
+    for (int i = 0; i < n; i++){
+        Point3D pt = get_vertex(pres->vertices, i);
+        pt.z += height;
+        add_vertex(pres, pt);
+    }
+    for (int i = 0; i < n_cap; i++){
+        add_triangle(pres,
+                     pres->indices[3*i] + n,
+                     pres->indices[3*i + 1] + n,
+                     pres->indices[3*i + 2] + n,
+                     pres->visible[i]);
+    }
+    // The bottom faces outwards
+    for (int i = 0; i < n_cap; i++){
+        flip_triangle(pres, i);
     }
-    // Bottom
-    TriangleMesh* poly2 = triangulate(ppoly);
-    flip_mesh(poly2);
 
     // Sides
-    TriangleMesh* psides = malloc(sizeof(TriangleMesh) + (2 * ppoly->size) * sizeof(Triangle));
-    psides->size = 0;
     PolygonVertex* pcurr_vertex = ppoly->head;
     // Two triangles per sides
-    Triangle tri1, tri2;
+    int curr, next;
     do {
+        curr = pcurr_vertex->index;
+        next = pcurr_vertex->next->index;
         // Triangle 1
-        tri1.a.x = pcurr_vertex->next->coordinates.x;
-        tri1.a.y = pcurr_vertex->next->coordinates.y;
-        tri1.a.z = 0;
-        tri1.b.x = pcurr_vertex->coordinates.x;
-        tri1.b.y = pcurr_vertex->coordinates.y;
-        tri1.b.z = 0;
-        tri1.c.x = pcurr_vertex->coordinates.x;
-        tri1.c.y = pcurr_vertex->coordinates.y;
-        tri1.c.z = height;
-        tri1.visible[0] = true;
-        tri1.visible[1] = true;
-        tri1.visible[2] = false;
-        psides = add_triangle(psides, tri1);
-
+        add_triangle(pres, next, curr, curr + n, EDGE_AB | EDGE_BC);
         // Triangle 2
-        tri2.a.x = pcurr_vertex->next->coordinates.x;
-        tri2.a.y = pcurr_vertex->next->coordinates.y;
-        tri2.a.z = 0;
-        tri2.b.x = pcurr_vertex->coordinates.x;
-        tri2.b.y = pcurr_vertex->coordinates.y;
-        tri2.b.z = height;
-        tri2.c.x = pcurr_vertex->next->coordinates.x;
-        tri2.c.y = pcurr_vertex->next->coordinates.y;
-        tri2.c.z = height;
-        tri2.visible[0] = false;
-        tri2.visible[1] = true;
-        tri2.visible[2] = true;
-        psides = add_triangle(psides, tri2);
+        add_triangle(pres, next, curr + n, next + n, EDGE_BC | EDGE_CA);
 
         pcurr_vertex = pcurr_vertex->next;
     } while (pcurr_vertex != ppoly->head);
 
-    // Merging
-    poly1 = merge_tri_meshes(poly1, poly2);
-    poly1 = merge_tri_meshes(poly1, psides);
-    return poly1;
+    return pres;
 }
 
 // Homogeneous coordinates transforms
-Point3D transform_point(float* matrix, Point3D point){
-    Point3D res;
-    res.x = point.x * matrix[0] + point.y * matrix[1] + point.z * matrix[2] + matrix[3];
-    res.y = point.x * matrix[4] + point.y * matrix[5] + point.z * matrix[6] + matrix[7];
-    res.z = point.x * matrix[8] + point.y * matrix[9] + point.z * matrix[10] + matrix[11];
-    return res;
-}
-
-
-Triangle transform_triangle(float* matrix, Triangle tri){
-    Point3D trans_a, trans_b, trans_c;
-    Triangle trans_tri;
-
-    trans_a = transform_point(matrix, tri.a);
-    trans_b = transform_point(matrix, tri.b);
-    trans_c = transform_point(matrix, tri.c);
-
-    trans_tri.a = trans_a;
-    trans_tri.b = trans_b;
-    trans_tri.c = trans_c;
-    memcpy(trans_tri.visible, tri.visible, 3);
-
-    return trans_tri;
-}
-
 void transform_mesh(float* matrix, TriangleMesh* pmesh){
-    Triangle curr_tri;
-    for (int i = 0; i < pmesh->size; i++){
-        curr_tri = transform_triangle(matrix, pmesh->triangles[i]);
-        pmesh->triangles[i] = curr_tri;
-    }
+    // Shared vertices are only transformed once
+    transform_vertices(matrix, pmesh->vertices, pmesh->vertices, pmesh->n_vertices);
 }
 
 
@@ -193,135 +286,376 @@ void rotate_mesh(TriangleMesh* pmesh, Point3D rotation){
 }
 
 TriangleMesh* copy_mesh(TriangleMesh* pmesh){
-    int size_in_memory = sizeof(TriangleMesh) + sizeof(Triangle) * pmesh->size;
-    TriangleMesh* pcopy = (TriangleMesh*) malloc(size_in_memory);
-    check_allocation(pcopy, "Couldn't allocate memory to copy the mesh\n");
-    memcpy(pcopy, pmesh, size_in_memory);
+    TriangleMesh* pcopy = new_triangle_mesh(pmesh->n_vertices, pmesh->size);
+    append_mesh(pcopy, pmesh);
     return pcopy;
 }
 
-void reflect_mesh(TriangleMesh* pmesh, Point3D normal){
+void calculate_reflection_matrix(float* matrix, Point3D normal){
     // Normalizing vector
     Point3D unit_norm = normalize(normal);
-    float matrix[16] = {
+    float reflection[16] = {
         1 - 2*unit_norm.x*unit_norm.x, -2*unit_norm.x*unit_norm.y, -2*unit_norm.x*unit_norm.z, 0,
         -2*unit_norm.x*unit_norm.y, 1 - 2*unit_norm.y*unit_norm.y, -2*unit_norm.y*unit_norm.z, 0,
         -2*unit_norm.x*unit_norm.z, -2*unit_norm.y*unit_norm.z, 1-2*unit_norm.z*unit_norm.z, 0,
         0, 0, 0, 1,
     };
+    memcpy(matrix, reflection, sizeof(reflection));
+}
+
+void reflect_mesh(TriangleMesh* pmesh, Point3D normal){
+    float matrix[16];
+    calculate_reflection_matrix(matrix, normal);
     transform_mesh(matrix, pmesh);
     flip_mesh(pmesh);
 }
 
-bool facing_camera(Triangle tri){
-    Point3D vect_1 = pt_diff(tri.b, tri.a),
-            vect_2 = pt_diff(tri.a, tri.c);
-    Point3D normal = cross_product(vect_1, vect_2);
-    Point3D center = pt_mul((float)1/3, pt_add(pt_add(tri.a, tri.b), tri.c));
-    return (dot_product(center, normal) >= 0);
+// Transforms a mesh with any combination of rotations, translations and
+// reflections. Mirrored meshes get their triangles flipped, so they still
+// face outwards
+void apply_transform(float* matrix, TriangleMesh* pmesh){
+    transform_mesh(matrix, pmesh);
+    if (is_mirroring(matrix))
+        flip_mesh(pmesh);
 }
 
-int comp_tri_z(const void* ptri_a, const void* ptri_b){
-    Point3D tri_a_a = ((Triangle*) ptri_a)->a,
-            tri_a_b = ((Triangle*) ptri_a)->b,
-            tri_a_c = ((Triangle*) ptri_a)->c,
-            tri_b_a = ((Triangle*) ptri_b)->a,
-            tri_b_b = ((Triangle*) ptri_b)->b,
-            tri_b_c = ((Triangle*) ptri_b)->c;
+// True if the matrix turns shapes inside out, like an odd number of reflections
+bool is_mirroring(float* matrix){
+    float determinant = matrix[0] * (matrix[5] * matrix[10] - matrix[6] * matrix[9])
+                      - matrix[1] * (matrix[4] * matrix[10] - matrix[6] * matrix[8])
+                      + matrix[2] * (matrix[4] * matrix[9] - matrix[5] * matrix[8]);
+    return determinant < 0;
+}
 
-    float min_z_a = fminf(fminf(tri_a_a.z, tri_a_b.z), tri_a_c.z),
-          min_z_b = fminf(fminf(tri_b_a.z, tri_b_b.z), tri_b_c.z);
+// Face planes
+// The normal is the one the triangle is seen from, the way it is wound
+FacePlanes* build_face_planes(TriangleMesh* pmesh){
+    FacePlanes* pres = (FacePlanes*) malloc(sizeof(FacePlanes) + 4 * pmesh->size * sizeof(float));
+    check_allocation(pres, "Couldn't allocate memory for the face planes\n");
+    pres->size = pmesh->size;
+    pres->nx = (float*) (pres + 1);
+    pres->ny = pres->nx + pmesh->size;
+    pres->nz = pres->ny + pmesh->size;
+    pres->d = pres->nz + pmesh->size;
+
+    Triangle tri;
+    Point3D normal, center;
+    for (int i = 0; i < pmesh->size; i++){
+        tri = get_triangle(pmesh, i);
+        normal = cross_product(pt_diff(tri.b, tri.a), pt_diff(tri.a, tri.c));
+        center = pt_mul((float)1/3, pt_add(pt_add(tri.a, tri.b), tri.c));
+        pres->nx[i] = normal.x;
+        pres->ny[i] = normal.y;
+        pres->nz[i] = normal.z;
+        pres->d[i] = dot_product(center, normal);
+    }
+    return pres;
+}
+
+
+// Culled mesh
+// The buffers are kept from one frame to the next, and only grow with the scene
+CulledMesh* new_culled_mesh(){
+    CulledMesh* pres = (CulledMesh*) calloc(1, sizeof(CulledMesh));
+    check_allocation(pres, "Couldn't allocate memory for the culled mesh\n");
+    return pres;
+}
+
+void reserve_culled_mesh(CulledMesh* pculled, TriangleMesh* pmesh){
+    // Nothing is kept from the previous frame, no need to copy anything
+    if (pmesh->n_vertices > pculled->vertex_capacity){
+        free(pculled->vertices.x);
+        free(pculled->vertices.y);
+        free(pculled->vertices.z);
+        free(pculled->projected);
+        free(pculled->inside);
+        pculled->vertices.x = (float*) malloc(pmesh->n_vertices * sizeof(float));
+        pculled->vertices.y = (float*) malloc(pmesh->n_vertices * sizeof(float));
+        pculled->vertices.z = (float*) malloc(pmesh->n_vertices * sizeof(float));
+        pculled->projected = (Point2D*) malloc(pmesh->n_vertices * sizeof(Point2D));
+        pculled->inside = (bool*) malloc(pmesh->n_vertices * sizeof(bool));
+        check_allocation(pculled->vertices.x, "Couldn't allocate memory for the culled mesh\n");
+        check_allocation(pculled->vertices.y, "Couldn't allocate memory for the culled mesh\n");
+        check_allocation(pculled->vertices.z, "Couldn't allocate memory for the culled mesh\n");
+        check_allocation(pculled->projected, "Couldn't allocate memory for the culled mesh\n");
+        check_allocation(pculled->inside, "Couldn't allocate memory for the culled mesh\n");
+        pculled->vertex_capacity = pmesh->n_vertices;
+    }
+    if (pmesh->size > pculled->capacity){
+        free(pculled->triangles);
+        free(pculled->kept);
+        free(pculled->previous);
+        pculled->triangles = (int*) malloc(pmesh->size * sizeof(int));
+        pculled->kept = (bool*) malloc(pmesh->size * sizeof(bool));
+        pculled->previous = (int*) malloc(pmesh->size * sizeof(int));
+        check_allocation(pculled->triangles, "Couldn't allocate memory for the culled mesh\n");
+        check_allocation(pculled->kept, "Couldn't allocate memory for the culled mesh\n");
+        check_allocation(pculled->previous, "Couldn't allocate memory for the culled mesh\n");
+        pculled->previous_size = 0;
+        pculled->capacity = pmesh->size;
+    }
+}
+
+void free_culled_mesh(CulledMesh* pculled){
+    free(pculled->vertices.x);
+    free(pculled->vertices.y);
+    free(pculled->vertices.z);
+    free(pculled->projected);
+    free(pculled->inside);
+    free(pculled->triangles);
+    free(pculled->kept);
+    free(pculled->previous);
+    free(pculled);
+}
+
+// Returns the i-th triangle that survived culling, in camera space
+Triangle get_culled_triangle(CulledMesh* pculled, int i){
+    int* pidx = &pculled->pmesh->indices[3*pculled->triangles[i]];
+    Triangle res = {
+        get_vertex(pculled->vertices, pidx[0]),
+        get_vertex(pculled->vertices, pidx[1]),
+        get_vertex(pculled->vertices, pidx[2])
+    };
+    return res;
+}
 
-    if (min_z_a < min_z_b)
-        return -1;
-    else if (min_z_a == min_z_b)
-        return 0;
-    else
-        return 1;
+// Brings the vertices to camera space and projects them, spread across the workers
+void transform_and_project(CulledMesh* pculled, Camera* pcam){
+    CullJob job = {pculled, pcam};
+    run_on_workers(project_worker, &job);
 }
 
-TriangleMesh* bface_cull(TriangleMesh* ptri){
-    TriangleMesh* pres = new_triangle_mesh(0);
-    Triangle curr_tri;
+void project_worker(void* pdata, int worker){
+    CullJob* pjob = (CullJob*) pdata;
+    int start, end;
+    while (next_chunk(&pjob->next_vertex, VERTEX_CHUNK, pjob->pculled->pmesh->n_vertices,
+                      &start, &end))
+        project_vertices(pjob->pculled, pjob->pcam, start, end);
+}
 
-    for (int i = 0; i < ptri->size; i++){
-        curr_tri = ptri->triangles[i];
-        if (facing_camera(curr_tri)){
-            pres = add_triangle(pres, curr_tri);
+// This is done a chunk at a time, so that the vertices are projected while
+// still in cache
+void project_vertices(CulledMesh* pculled, Camera* pcam, int first, int last){
+    TriangleMesh* pmesh = pculled->pmesh;
+    VertexArray src, dest;
+    Point2D projected;
+    int end;
+
+    for (int start = first; start < last; start += CULL_CHUNK){
+        end = start + CULL_CHUNK < last ? start + CULL_CHUNK : last;
+        src.x = &pmesh->vertices.x[start];
+        src.y = &pmesh->vertices.y[start];
+        src.z = &pmesh->vertices.z[start];
+        dest.x = &pculled->vertices.x[start];
+        dest.y = &pculled->vertices.y[start];
+        dest.z = &pculled->vertices.z[start];
+        transform_vertices(pcam->transform_mat, src, dest, end - start);
+
+        for (int i = start; i < end; i++){
+            projected = project_point(get_vertex(pculled->vertices, i), pcam);
+            pculled->projected[i] = projected;
+            pculled->inside[i] = pculled->vertices.z[i] >= pcam->focal_length &&
+                                 fabsf(projected.x) <= pcam->width/2 &&
+                                 fabsf(projected.y) <= pcam->height/2;
         }
     }
-    return pres;
 }
 
-TriangleMesh* frustum_cull(TriangleMesh* ptri, Camera* pcam){
-    TriangleMesh* pres = new_triangle_mesh(0);
-    Triangle curr_tri;
-    Point2D a_proj, b_proj, c_proj;
-
-    for (int i = 0; i < ptri->size; i++){
-        curr_tri = ptri->triangles[i];
-        // Are all three vertices behind the focal plan ?
-        if (curr_tri.a.z < pcam->focal_length &&
-            curr_tri.b.z < pcam->focal_length &&
-            curr_tri.c.z < pcam->focal_length)
-            continue;
+// Frustum culling (always) and back-face culling, in a single pass over
+// the triangles spread across the workers. Only the indices of the
+// remaining triangles are kept, in the same order as in the mesh
+void cull_triangles(CulledMesh* pculled, FacePlanes* pplanes, Camera* pcam, bool do_bface_cull,
+                    Arena* parena){
+    CullJob job = {pculled, pcam};
+    job.params.indices = pculled->pmesh->indices;
+    job.params.vertices = pculled->vertices;
+    job.params.pplanes = pplanes;
+    job.params.focal_length = pcam->focal_length;
+    job.params.half_width = pcam->width/2;
+    job.params.half_height = pcam->height/2;
+    job.params.bface_cull = do_bface_cull;
+
+    // The camera's position is what the transform brings to the origin
+    float inverse_mat[16];
+    invert_affine_matrix(pcam->transform_mat, inverse_mat);
+    job.params.eye.x = inverse_mat[3];
+    job.params.eye.y = inverse_mat[7];
+    job.params.eye.z = inverse_mat[11];
+
+    int size = pculled->pmesh->size;
+    job.n_chunks = (size + TRIANGLE_CHUNK - 1) / TRIANGLE_CHUNK;
+    job.pleft = (int*) arena_alloc(parena, size * sizeof(int));
+    job.psizes = (int*) arena_alloc(parena, job.n_chunks * sizeof(int));
+    job.poffsets = (int*) arena_alloc(parena, job.n_chunks * sizeof(int));
+    run_on_workers(cull_worker, &job);
+
+    pculled->size = 0;
+    for (int i = 0; i < job.n_chunks; i++){
+        job.poffsets[i] = pculled->size;
+        pculled->size += job.psizes[i];
+    }
+    job.next_chunk = 0;
+    run_on_workers(compact_worker, &job);
+}
 
-        // Projecting the vertices
-        a_proj = project_point(curr_tri.a, pcam);
-        b_proj = project_point(curr_tri.b, pcam);
-        c_proj = project_point(curr_tri.c, pcam);
+void cull_worker(void* pdata, int worker){
+    CullJob* pjob = (CullJob*) pdata;
+    int start, end;
+    while (next_chunk(&pjob->next_chunk, TRIANGLE_CHUNK, pjob->pculled->pmesh->size, &start, &end))
+        pjob->psizes[start / TRIANGLE_CHUNK] = cull(&pjob->params, start, end,
+                                                    pjob->pculled->kept, pjob->pleft + start);
+}
 
-        // Are all three vertices left of the frustum ?
-        if (a_proj.x < -pcam->width/2 &&
-            b_proj.x < -pcam->width/2 &&
-            c_proj.x < -pcam->width/2) 
-            continue;
- 
-        // Are all three vertices right of the frustum ?
-        if (a_proj.x > pcam->width/2 &&
-            b_proj.x > pcam->width/2 &&
-            c_proj.x > pcam->width/2) 
-            continue;
- 
-        // Are all three vertices above the frustum ?
-        if (a_proj.y < -pcam->width/2 &&
-            b_proj.y < -pcam->width/2 &&
-            c_proj.y < -pcam->width/2) 
-            continue;
+void compact_worker(void* pdata, int worker){
+    CullJob* pjob = (CullJob*) pdata;
+    int start, end;
+    while (next_chunk(&pjob->next_chunk, 1, pjob->n_chunks, &start, &end))
+        memcpy(pjob->pculled->triangles + pjob->poffsets[start],
+               pjob->pleft + start * TRIANGLE_CHUNK, pjob->psizes[start] * sizeof(int));
+}
 
-        // Are all three vertices above the frustum ?
-        if (a_proj.y > pcam->width/2 &&
-            b_proj.y > pcam->width/2 &&
-            c_proj.y > pcam->width/2) 
-            continue;
+// Sorting the triangles by their closest vertex. Triangles as close as
+// each other stay in the mesh's order, so the result is the same whichever
+// way it was sorted
+void z_sort_triangles(CulledMesh* pculled, Arena* parena){
+    TriangleMesh* pmesh = pculled->pmesh;
+    int* pidx;
+    float min_z;
+
+    // The keys are found by triangle, the previous order needs them too
+    uint32_t* pkeys = (uint32_t*) arena_alloc(parena, pmesh->size * sizeof(uint32_t));
+    for (int i = 0; i < pculled->size; i++){
+        pidx = &pmesh->indices[3*pculled->triangles[i]];
+        min_z = fminf(fminf(pculled->vertices.z[pidx[0]], pculled->vertices.z[pidx[1]]),
+                      pculled->vertices.z[pidx[2]]);
+        pkeys[pculled->triangles[i]] = depth_key(min_z);
+    }
 
-        // The triangle is inside the frustum, add it
-        pres = add_triangle(pres, curr_tri);
+    if (!sort_like_before(pculled, pkeys, parena)){
+        uint32_t* psorted_keys = (uint32_t*) arena_alloc(parena, pculled->size * sizeof(uint32_t));
+        for (int i = 0; i < pculled->size; i++)
+            psorted_keys[i] = pkeys[pculled->triangles[i]];
+        radix_sort(pculled->triangles, psorted_keys, pculled->size, parena);
     }
-    return pres;
+
+    // Kept for the next frame
+    memcpy(pculled->previous, pculled->triangles, pculled->size * sizeof(int));
+    pculled->previous_size = pculled->size;
 }
 
-void z_sort_triangles(TriangleMesh* pmesh){
-    qsort(pmesh->triangles, pmesh->size, sizeof(Triangle), comp_tri_z);
+// The bits of a float, changed so that they compare like the float
+uint32_t depth_key(float z){
+    uint32_t bits;
+    memcpy(&bits, &z, sizeof(float));
+    return (bits & 0x80000000) ? ~bits : bits | 0x80000000;
 }
 
-TriangleMesh* transform_and_cull(TriangleMesh* pmesh, Camera* pcam, bool do_bface_cull){
-    // Creating a copy of the mesh for transform
-    TriangleMesh* pmesh_transformed = copy_mesh(pmesh);
-    // 3D transform
-    transform_mesh(pcam->transform_mat, pmesh_transformed);
-    // Culling
-    TriangleMesh* pculled_tri;
-    TriangleMesh* pfrustum_culled;
-    // Frustum culling (always)
-    pfrustum_culled = frustum_cull(pmesh_transformed, pcam);
-    if (do_bface_cull){
-        pculled_tri = bface_cull(pfrustum_culled);
-        free(pfrustum_culled);
-    } else {
-        pculled_tri = pfrustum_culled;
+// When the camera barely moved, the previous order is almost right. The
+// triangles still there are taken in that order, the new ones added at the
+// end, and everything is put back in place by an insertion sort. If that
+// takes too many moves, the camera moved too much and nothing is changed
+bool sort_like_before(CulledMesh* pculled, uint32_t* pkeys, Arena* parena){
+    TriangleMesh* pmesh = pculled->pmesh;
+    int n = pculled->size;
+    if (pculled->previous_size == 0 || n == 0)
+        return false;
+
+    bool* ptaken = (bool*) arena_alloc(parena, pmesh->size * sizeof(bool));
+    memset(ptaken, 0, pmesh->size * sizeof(bool));
+    int* porder = pculled->previous;
+    int size = 0, t;
+    for (int i = 0; i < pculled->previous_size; i++){
+        t = porder[i];
+        // The mesh may have been reloaded since
+        if (t < pmesh->size && pculled->kept[t] && !ptaken[t]){
+            ptaken[t] = true;
+            porder[size++] = t;
+        }
+    }
+    if (n - size > n / 8)
+        return false;
+    for (int i = 0; i < n; i++){
+        if (!ptaken[pculled->triangles[i]])
+            porder[size++] = pculled->triangles[i];
+    }
+
+    int moves = 0, j;
+    uint32_t key;
+    for (int i = 1; i < n; i++){
+        t = porder[i];
+        key = pkeys[t];
+        for (j = i; j > 0 && (pkeys[porder[j - 1]] > key ||
+                              (pkeys[porder[j - 1]] == key && porder[j - 1] > t)); j--)
+            porder[j] = porder[j - 1];
+        porder[j] = t;
+        moves += i - j;
+        if (moves > n)
+            return false;
+    }
+
+    memcpy(pculled->triangles, porder, n * sizeof(int));
+    return true;
+}
+
+// Least significant digit first. Each pass keeps the order of the previous
+// one, so equal keys keep the order the values came in
+void radix_sort(int* pvalues, uint32_t* pkeys, int n, Arena* parena){
+    int* pvalues_tmp = (int*) arena_alloc(parena, n * sizeof(int));
+    uint32_t* pkeys_tmp = (uint32_t*) arena_alloc(parena, n * sizeof(uint32_t));
+    int counts[RADIX_PASSES][RADIX_SIZE];
+    memset(counts, 0, sizeof(counts));
+
+    // All the histograms in a single read of the keys
+    for (int i = 0; i < n; i++){
+        for (int pass = 0; pass < RADIX_PASSES; pass++)
+            counts[pass][(pkeys[i] >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1)] += 1;
+    }
+
+    int* psrc_values = pvalues;
+    uint32_t* psrc_keys = pkeys;
+    int* pdest_values = pvalues_tmp;
+    uint32_t* pdest_keys = pkeys_tmp;
+    int offset, count, digit, shift;
+    for (int pass = 0; pass < RADIX_PASSES; pass++){
+        shift = pass * RADIX_BITS;
+        // Nothing to do if every key has the same digit
+        if (n == 0 || counts[pass][(psrc_keys[0] >> shift) & (RADIX_SIZE - 1)] == n)
+            continue;
+
+        offset = 0;
+        for (int i = 0; i < RADIX_SIZE; i++){
+            count = counts[pass][i];
+            counts[pass][i] = offset;
+            offset += count;
+        }
+        for (int i = 0; i < n; i++){
+            digit = (psrc_keys[i] >> shift) & (RADIX_SIZE - 1);
+            pdest_keys[counts[pass][digit]] = psrc_keys[i];
+            pdest_values[counts[pass][digit]++] = psrc_values[i];
+        }
+
+        int* pswap_values = psrc_values;
+        uint32_t* pswap_keys = psrc_keys;
+        psrc_values = pdest_values;
+        psrc_keys = pdest_keys;
+        pdest_values = pswap_values;
+        pdest_keys = pswap_keys;
     }
-    z_sort_triangles(pculled_tri);
-    return pculled_tri;
+
+    if (psrc_values != pvalues)
+        memcpy(pvalues, psrc_values, n * sizeof(int));
 }
 
+// Fills the culled mesh with the mesh as seen from the camera. Nothing
+// scene-sized is allocated once the buffers are large enough, the scratch
+// space comes from the frame arena
+void transform_and_cull(CulledMesh* pculled, TriangleMesh* pmesh, FacePlanes* pplanes,
+                        Camera* pcam, bool do_bface_cull, Arena* parena){
+    pculled->pmesh = pmesh;
+    reserve_culled_mesh(pculled, pmesh);
+
+    // Every vertex is needed before any triangle can be culled
+    transform_and_project(pculled, pcam);
+    cull_triangles(pculled, pplanes, pcam, do_bface_cull, parena);
+    z_sort_triangles(pculled, parena);
+}
@@ -6,20 +6,40 @@
 #include <math.h>
 #include "primitives.h"
 #include "camera.h"
+#include "arena.h"
 
-TriangleMesh* transform_and_cull(TriangleMesh* pmesh, Camera* pcam, bool do_bface_cull);
+FacePlanes* build_face_planes(TriangleMesh* pmesh);
+CulledMesh* new_culled_mesh();
+void reserve_culled_mesh(CulledMesh* pculled, TriangleMesh* pmesh);
+void transform_and_cull(CulledMesh* pculled, TriangleMesh* pmesh, FacePlanes* pplanes,
+                        Camera* pcam, bool do_bface_cull, Arena* parena);
+void transform_and_project(CulledMesh* pculled, Camera* pcam);
+void cull_triangles(CulledMesh* pculled, FacePlanes* pplanes, Camera* pcam, bool do_bface_cull,
+                    Arena* parena);
+void z_sort_triangles(CulledMesh* pculled, Arena* parena);
+void free_culled_mesh(CulledMesh* pculled);
+Triangle get_culled_triangle(CulledMesh* pculled, int i);
 
-TriangleMesh* add_triangle(TriangleMesh* pmesh, Triangle tri);
+void reserve_mesh(TriangleMesh* pmesh, int n_vertices, int size);
+int add_vertex(TriangleMesh* pmesh, Point3D vertex);
+void add_triangle(TriangleMesh* pmesh, int a, int b, int c, uint8_t visible);
+void append_mesh(TriangleMesh* pdest, TriangleMesh* psrc);
+void append_transformed_mesh(TriangleMesh* pdest, TriangleMesh* psrc, float* matrix);
+void copy_transformed_mesh(TriangleMesh* pdest, TriangleMesh* psrc, float* matrix,
+                           int first_vertex, int first_triangle);
 TriangleMesh* merge_tri_meshes(TriangleMesh* pmesh1, TriangleMesh* pmesh2);
-void flip_triangle(Triangle* ptri);
+void flip_triangle(TriangleMesh* pmesh, int i);
 void flip_mesh(TriangleMesh* pmesh);
 TriangleMesh* extrude(Polygon* ppoly, float height);
 void calculate_rotation_matrix(float* matrix, Point3D rotation);
 void calculate_translation_matrix(float* matrix, Point3D translation);
+void calculate_reflection_matrix(float* matrix, Point3D normal);
 void translate_mesh(TriangleMesh* pmesh, Point3D translation);
 void rotate_mesh(TriangleMesh* pmesh, Point3D rotation);
 void reflect_mesh(TriangleMesh* pmesh, Point3D normal);
 void transform_mesh(float* matrix, TriangleMesh* pmesh);
+void apply_transform(float* matrix, TriangleMesh* pmesh);
+bool is_mirroring(float* matrix);
 TriangleMesh* copy_mesh(TriangleMesh* pmesh);
 
 #endif
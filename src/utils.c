@@ -16,8 +16,9 @@ float deg_to_rad(float deg){
 }
 
 Point2D project_point(Point3D point, Camera* pcam){
-    float x = point.x * (pcam->focal_length / (point.z));
-    float y = point.y * (pcam->focal_length / (point.z));
+    float ratio = pcam->focal_length / point.z;
+    float x = point.x * ratio;
+    float y = point.y * ratio;
     Point2D res = {x, y};
     return res;
 }
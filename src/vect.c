@@ -84,6 +84,42 @@ void multiply_matrix(float* matB, float* matA){
     memcpy(matB, res, sizeof(float) * 16);
 }
 
+// Inverse of a transform made of a rotation/scaling and a translation
+void invert_affine_matrix(float* matrix, float* inverse){
+    // Inverting the 3x3 part with its cofactors
+    float c0 = matrix[5] * matrix[10] - matrix[6] * matrix[9],
+          c1 = matrix[6] * matrix[8] - matrix[4] * matrix[10],
+          c2 = matrix[4] * matrix[9] - matrix[5] * matrix[8];
+    float inv_det = 1 / (matrix[0] * c0 + matrix[1] * c1 + matrix[2] * c2);
+
+    inverse[0] = c0 * inv_det;
+    inverse[1] = (matrix[2] * matrix[9] - matrix[1] * matrix[10]) * inv_det;
+    inverse[2] = (matrix[1] * matrix[6] - matrix[2] * matrix[5]) * inv_det;
+    inverse[4] = c1 * inv_det;
+    inverse[5] = (matrix[0] * matrix[10] - matrix[2] * matrix[8]) * inv_det;
+    inverse[6] = (matrix[2] * matrix[4] - matrix[0] * matrix[6]) * inv_det;
+    inverse[8] = c2 * inv_det;
+    inverse[9] = (matrix[1] * matrix[8] - matrix[0] * matrix[9]) * inv_det;
+    inverse[10] = (matrix[0] * matrix[5] - matrix[1] * matrix[4]) * inv_det;
+
+    // Undoing the translation
+    inverse[3] = -(inverse[0] * matrix[3] + inverse[1] * matrix[7] + inverse[2] * matrix[11]);
+    inverse[7] = -(inverse[4] * matrix[3] + inverse[5] * matrix[7] + inverse[6] * matrix[11]);
+    inverse[11] = -(inverse[8] * matrix[3] + inverse[9] * matrix[7] + inverse[10] * matrix[11]);
+
+    inverse[12] = inverse[13] = inverse[14] = 0;
+    inverse[15] = 1;
+}
+
+// Homogeneous coordinates transform of a single point
+Point3D transform_point(float* matrix, Point3D point){
+    Point3D res;
+    res.x = point.x * matrix[0] + point.y * matrix[1] + point.z * matrix[2] + matrix[3];
+    res.y = point.x * matrix[4] + point.y * matrix[5] + point.z * matrix[6] + matrix[7];
+    res.z = point.x * matrix[8] + point.y * matrix[9] + point.z * matrix[10] + matrix[11];
+    return res;
+}
+
 bool pt_is_null(Point3D pt){
     return (pt.x == 0 && pt.y == 0 && pt.z == 0);
 }
@@ -95,3 +131,18 @@ float pt_len(Point3D pt){
 Point3D normalize(Point3D vect){
     return pt_mul(1/pt_len(vect), vect);
 }
+
+// Bounding box
+BoundingBox bbox_from_triangle(Triangle triangle){
+    BoundingBox res;
+    res.min = pt_min(pt_min(triangle.a, triangle.b), triangle.c);
+    res.max = pt_max(pt_max(triangle.a, triangle.b), triangle.c);
+    return res;
+}
+
+BoundingBox bbox_from_edge(Edge3D edge){
+    BoundingBox res;
+    res.min = pt_min(edge.a, edge.b);
+    res.max = pt_max(edge.a, edge.b);
+    return res;
+}
@@ -17,7 +17,11 @@ float dot_product(Point3D a, Point3D b);
 Point3D pt_min(Point3D a, Point3D b);
 Point3D pt_max(Point3D a, Point3D b);
 void multiply_matrix(float* ma, float* mb);
+void invert_affine_matrix(float* matrix, float* inverse);
+Point3D transform_point(float* matrix, Point3D point);
 void check_allocation(void* pointer, char* message);
 Point3D normalize(Point3D vect);
+BoundingBox bbox_from_edge(Edge3D edge);
+BoundingBox bbox_from_triangle(Triangle triangle);
 
 #endif
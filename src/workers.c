@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+#define MAX_WORKERS 64
+
+// Threads sleep between jobs instead of being created for every frame
+static pthread_t threads[MAX_WORKERS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER; // One job at a time
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static int n_threads = 0; // Not counting the calling thread
+static int generation = 0;
+static int n_running = 0;
+static bool quitting = false;
+static WorkerJob current_job = NULL;
+static void* pcurrent_data = NULL;
+
+
+void* worker_loop(void* parg){
+    int worker = (int) (long) parg;
+    int seen = 0;
+
+    pthread_mutex_lock(&lock);
+    for (;;){
+        while (generation == seen && !quitting)
+            pthread_cond_wait(&job_ready, &lock);
+        if (quitting)
+            break;
+        seen = generation;
+        WorkerJob job = current_job;
+        void* pdata = pcurrent_data;
+        pthread_mutex_unlock(&lock);
+
+        job(pdata, worker);
+
+        pthread_mutex_lock(&lock);
+        n_running -= 1;
+        if (n_running == 0)
+            pthread_cond_signal(&job_done);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Starts the worker threads, one per core if n_workers is 0
+void start_workers(int n_workers){
+    if (n_workers <= 0)
+        n_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers < 1)
+        n_workers = 1;
+    if (n_workers > MAX_WORKERS)
+        n_workers = MAX_WORKERS;
+
+    quitting = false;
+    for (int i = 1; i < n_workers; i++){
+        if (pthread_create(&threads[i - 1], NULL, worker_loop, (void*) (long) i) != 0)
+            break;
+        n_threads += 1;
+    }
+    printf("Using %d worker thread(s)\n", n_threads + 1);
+}
+
+void stop_workers(){
+    pthread_mutex_lock(&lock);
+    quitting = true;
+    pthread_cond_broadcast(&job_ready);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    n_threads = 0;
+}
+
+int worker_count(){
+    return n_threads + 1;
+}
+
+// Runs a job on every worker and waits for all of them to be done.
+// Jobs from different threads are run one after the other. Must not be
+// called from inside a job
+void run_on_workers(WorkerJob job, void* pdata){
+    if (n_threads == 0){
+        job(pdata, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&submit_lock);
+    pthread_mutex_lock(&lock);
+    current_job = job;
+    pcurrent_data = pdata;
+    n_running = n_threads;
+    generation += 1;
+    pthread_cond_broadcast(&job_ready);
+    pthread_mutex_unlock(&lock);
+
+    job(pdata, 0);
+
+    pthread_mutex_lock(&lock);
+    while (n_running > 0)
+        pthread_cond_wait(&job_done, &lock);
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&submit_lock);
+}
+
+// Hands out [0, size) in chunks, to whichever worker asks first.
+// Returns false once everything has been handed out
+bool next_chunk(int* pnext, int chunk_size, int size, int* pstart, int* pend){
+    int start = __atomic_fetch_add(pnext, chunk_size, __ATOMIC_RELAXED);
+    if (start >= size)
+        return false;
+    *pstart = start;
+    *pend = start + chunk_size < size ? start + chunk_size : size;
+    return true;
+}
@@ -0,0 +1,15 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdbool.h>
+
+// Work given to every worker. The calling thread takes part as worker 0
+typedef void (*WorkerJob)(void* pdata, int worker);
+
+void start_workers(int n_workers);
+void stop_workers();
+int worker_count();
+void run_on_workers(WorkerJob job, void* pdata);
+bool next_chunk(int* pnext, int chunk_size, int size, int* pstart, int* pend);
+
+#endif